@@ -0,0 +1,90 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+/**
+ * @brief A simple bump allocator over a single up-front reservation, used for
+ * every buffer a node needs so large transforms never touch the stack and
+ * nothing is allocated while data is flowing. All allocations are aligned to
+ * ARENA_ALIGNMENT bytes. Only arena_init() and arena_free() call into the
+ * system, arena_alloc() just hands out the next piece of the reservation.
+ *
+ */
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 64
+
+enum arena_pages {
+  ARENA_PAGES_NORMAL,       // Regular pages
+  ARENA_PAGES_TRANSPARENT,  // Ask for transparent huge pages with madvise
+  ARENA_PAGES_HUGE          // Explicit huge pages, must be reserved by the OS
+};
+
+/**
+ * @brief Opaque handle to an arena, members never need to be accessed
+ * directly.
+ *
+ */
+typedef struct arena_s *arena;
+
+/**
+ * @brief Reserves the memory for an arena and touches every page of it, so that
+ * with a first-touch NUMA policy it is placed next to the calling process.
+ * Falls back to transparent huge pages if explicit ones are unavailable.
+ *
+ * @param size The number of bytes to reserve, including alignment padding.
+ * @param pages The kind of pages to back the arena with.
+ * @return arena The new arena, NULL if the memory could not be reserved.
+ */
+arena arena_init(size_t size, enum arena_pages pages);
+
+/**
+ * @brief Gets the kind of pages an arena ended up backed with.
+ *
+ * @param mem The arena.
+ * @return enum arena_pages The kind of pages, ARENA_PAGES_TRANSPARENT if
+ * explicit huge pages were asked for but unavailable.
+ */
+enum arena_pages arena_page_kind(arena mem);
+
+/**
+ * @brief Calculates how many bytes to reserve for an allocation of the given
+ * size, including the worst case alignment padding.
+ *
+ * @param size The size of the allocation.
+ * @return size_t The number of bytes it takes up in an arena.
+ */
+size_t arena_size(size_t size);
+
+/**
+ * @brief Calculates the most bytes an arena can be asked for without its
+ * reservation, rounded up to whole pages, growing past a limit.
+ *
+ * @param limit The most bytes the reservation may take up.
+ * @param pages The kind of pages the arena will be backed with.
+ * @return size_t The limit rounded down to whole pages, 0 if it is smaller
+ * than one page.
+ */
+size_t arena_fit(size_t limit, enum arena_pages pages);
+
+/**
+ * @brief Allocates an aligned block from an arena.
+ *
+ * @param mem The arena to allocate from.
+ * @param size The number of bytes to allocate.
+ * @return void* The allocated block, NULL if the arena does not have enough
+ * space left.
+ */
+void *arena_alloc(arena mem, size_t size);
+
+/**
+ * @brief Returns the memory of an arena to the system and reassigns the handle
+ * to NULL.
+ *
+ * @param mem The arena to free.
+ */
+void arena_free(arena *mem);
+
+#endif  // ARENA_H_INCLUDED
@@ -1,15 +1,18 @@
 // This header contains a few functions to be used if the intrinsic functions
 // are unavailable. I doubt these are substantial or original enough to warrant
-// copyright.
+// copyright. Both work on 64 bits so they cover any transform size.
 #ifndef BITMANIP_H_INCLUDED
 #define BITMANIP_H_INCLUDED
 
+#include <stdint.h>
+
 #ifdef __GNUC__
 #include <limits.h>
-#define bit_length(x) (sizeof(int) * CHAR_BIT - __builtin_clz(x))
+#define bit_length(x) \
+  ((int)(sizeof(long long) * CHAR_BIT) - __builtin_clzll(x))
 #else
-unsigned int bit_length(unsigned int x) {
-  unsigned int bits = 0;
+int bit_length(uint64_t x) {
+  int bits = 0;
   while (x) {
     bits++;
     x >>= 1;
@@ -19,15 +22,25 @@ unsigned int bit_length(unsigned int x) {
 #endif  // __GNUC__
 
 #ifdef __clang__
-#define bit_reverse(x, n) (__builtin_bitreverse32(x) >> (32 - n))
+#define bit_reverse(x, n) \
+  ((int64_t)(__builtin_bitreverse64((uint64_t)(x)) >> (64 - (n))))
 #else
-unsigned int bit_reverse(unsigned int x, unsigned int n) {
-  unsigned int r = 0;
-  for (unsigned int i = 0; i < n; ++i) {
-    if (x & (1 << i)) r |= 1 << ((n - 1) - i);
-  }
-  return r;
+// Byte-wise lookup table, each entry is the reversal of its index
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+static const unsigned char bit_reverse_table[256] = {R6(0), R6(2), R6(1),
+                                                     R6(3)};
+#undef R6
+#undef R4
+#undef R2
+
+static inline int64_t bit_reverse(int64_t x, int n) {
+  uint64_t r = 0;
+  for (int byte = 0; byte < 8; byte++)
+    r = r << 8 | bit_reverse_table[((uint64_t)x >> (8 * byte)) & 0xff];
+  return (int64_t)(r >> (64 - n));
 }
 #endif // __clang__
 
-#endif  // BITMANIP_H_INCLUDED
\ No newline at end of file
+#endif  // BITMANIP_H_INCLUDED
@@ -0,0 +1,28 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+/**
+ * @brief Fully unrolled FFT kernels for small sizes, generated at build time by
+ * tools/gen_codelets.c. Each codelet performs the complete FFT of its size in
+ * place and, just like fft(), expects its input in bit reversal permutation
+ * order.
+ *
+ */
+#ifndef CODELETS_H_INCLUDED
+#define CODELETS_H_INCLUDED
+
+#include <complex.h>
+
+#define MAX_CODELET_SIZE 64
+
+typedef void (*fft_codelet)(double complex X[]);
+
+/**
+ * @brief Forward and inverse codelets indexed by the log2 of their size, from
+ * size 1 (which does nothing) up to MAX_CODELET_SIZE.
+ *
+ */
+extern const fft_codelet forward_codelets[];
+extern const fft_codelet inverse_codelets[];
+
+#endif  // CODELETS_H_INCLUDED
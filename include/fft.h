@@ -10,7 +10,8 @@
  * C++ using the internal array of a pre-sized vector would be a reasonable
  * substitute. These functions deliberately do not contain any logging, logging
  * must be done externally. This is to keep this functions as isolated,
- * performant, and portable as possible.
+ * performant, and portable as possible. Sizes and indices are 64-bit so a
+ * transform may be larger than 2^31 values.
  *
  */
 
@@ -18,6 +19,9 @@
 #define FFT_H_INCLUDED
 #include <complex.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define DEFAULT_LEAF_SIZE 32
 
 /**
  * @brief Prints out an array of complex numbers. Numbers are printed in a way
@@ -26,7 +30,7 @@
  * @param x Array of complex numbers.
  * @param N Size of array.
  */
-void print_complex(double complex *x, int N);
+void print_complex(double complex *x, int64_t N);
 
 /**
  * @brief Reads in a csv file into an array of double complex. File is expected
@@ -41,18 +45,33 @@ void print_complex(double complex *x, int N);
  *
  * @return A pointer to a dynamically allocated array of complex numbers.
  */
-double complex *csv2cmplx(const char *filename, bool header, int *N);
+double complex *csv2cmplx(const char *filename, bool header, int64_t *N);
+
+/**
+ * @brief Same as csv2cmplx but also reports how many values were actually read
+ * from the file before padding, needed when the unpadded length matters such as
+ * for linear convolution.
+ *
+ * @param filename The name of the file to attempt to open.
+ * @param header If true the first line of the file will be ignored.
+ * @param len The integer to store the number of values read from the file.
+ * @param N The integer to store the padded size of the complex number array.
+ *
+ * @return A pointer to a dynamically allocated array of complex numbers.
+ */
+double complex *csv2cmplx_len(const char *filename, bool header,
+                              int64_t *len, int64_t *N);
 
 /**
  * @brief Calculates fair power of two partitioning for N values across nodes
  * nodes. I think this algorithm is O(1) too!
  *
  * @param N Total number of values to be operated on, must be a power of two.
- * @param parts Preallocated array of ints that the resulting partition will be
- * stored in.
+ * @param parts Preallocated array that the resulting partition will be stored
+ * in.
  * @param nodes Number of nodes.
  */
-void partition_pow2(int N, int parts[], int nodes);
+void partition_pow2(int64_t N, int64_t parts[], int nodes);
 
 /**
  * @brief From an array of partition sizes this calculates how large the result
@@ -62,25 +81,42 @@ void partition_pow2(int N, int parts[], int nodes);
  * has their result size set to 0 and no destination set, these nodes are
  * expected to quit once they receive a result size of 0.
  *
- * @param result_size Preallocated array of ints to store result sizes in.
+ * @param result_size Preallocated array to store result sizes in.
  * @param result_dest Preallocated array of ints to store result destinations
  * in.
  * @param parts Array of partition sizes, in order from smallest to largest.
  * @param nodes The number of nodes, excluding the head node, in the current
  * system.
  */
-void result_targets(int result_size[], int result_dest[], int parts[],
+void result_targets(int64_t result_size[], int result_dest[], int64_t parts[],
                     int nodes);
 
 /**
  * @brief Performs a bit reversal permutation on the given array of complex
  * numbers to prepare them for the FFT. Will use compiler intrinsics if
- * available.
+ * available. Large arrays are permuted in cache sized tiles.
  *
  * @param x The array of complex numbers the FFT will be performed on.
  * @param N The size of the array, must be a power of two.
  */
-void bit_reversal_permutation(double complex *x, int N);
+void bit_reversal_permutation(double complex *x, int64_t N);
+
+/**
+ * @brief Out-of-place version of bit_reversal_permutation(), writes the bit
+ * reversal permutation of the values src[0], src[stride], src[2 * stride] and
+ * so on into dst, fusing the permutation with the copy. The slice of size n
+ * starting at s * n of the permutation of an array of size N is the copy of
+ * every N / n-th value starting at the log2(N / n) bit reversal of s, so a
+ * node's subset can be permuted straight into its send buffer.
+ *
+ * @param dst The array to store the n permuted numbers in, must not overlap
+ * src.
+ * @param src The array of complex numbers to permute.
+ * @param n The number of values to permute, must be a power of two.
+ * @param stride The distance between the values in src.
+ */
+void bit_reversal_copy(double complex *dst, const double complex *src,
+                       int64_t n, int64_t stride);
 
 /**
  * @brief A single FFT butterfly operation, used internally by fft(). Also used
@@ -92,12 +128,23 @@ void bit_reversal_permutation(double complex *x, int N);
  * @param inverse If true perform the inverse FFT operation, otherwise the
  * forward FFT is used.
  */
-void fft_butterfly(double complex X[], int n, bool inverse);
+void fft_butterfly(double complex X[], int64_t n, bool inverse);
+
+/**
+ * @brief Sets the size of the blocks fft() transforms with a single generated
+ * codelet before moving on to the general butterflies. Exposed for tuning, the
+ * default is DEFAULT_LEAF_SIZE. A size of 1 disables the codelets.
+ *
+ * @param size The leaf size, must be a power of two no larger than
+ * MAX_CODELET_SIZE.
+ */
+void fft_set_leaf_size(int size);
 
 /**
  * @brief The Fast-Fourier Transform algorithm, computes the Fourier transform
  * on a set of complex numbers. The input array must be a power of two in size,
- * already be in bit reversal permutation order, and will be overwritten.
+ * already be in bit reversal permutation order, and will be overwritten. The
+ * first levels are done with the generated codelets, see fft_set_leaf_size().
  *
  * @param X The input set of complex numbers, must be a power of two in size,
  * and will be overwritten by the results.
@@ -105,52 +152,111 @@ void fft_butterfly(double complex X[], int n, bool inverse);
  * @param inverse If true perform the inverse FFT operation, otherwise the
  * forward FFT is used.
  */
-void fft(double complex X[], int n, bool inverse);
+void fft(double complex X[], int64_t n, bool inverse);
+
+/**
+ * @brief Does part of a fft_butterfly(), pairs first through last - 1 with
+ * their counterparts in the back half. Lets a butterfly start on a result set
+ * while the rest of it is still arriving.
+ *
+ * @param X Dataset to perform butterfly operation on, will be overwritten and
+ * must be a power of two in size.
+ * @param n The size of the whole butterfly operation/input set.
+ * @param inverse If true perform the inverse FFT operation, otherwise the
+ * forward FFT is used.
+ * @param first The first element of the front half to do.
+ * @param last One past the last element of the front half to do, no more than
+ * n / 2.
+ */
+void fft_butterfly_range(double complex X[], int64_t n, bool inverse,
+                         int64_t first, int64_t last);
 
 /**
- * @brief Linked-list used for storing FFT-chunks received out-of-order. Members
- * never need to be accessed directly, consider it an opaque handle. That is why
- * the pointer is typedef'd.
+ * @brief Finds which butterflies of size n feed the requested output bins,
+ * every aligned block of size n needs the same ones.
  *
+ * @param n The size of the butterfly operation.
+ * @param bins The requested output bins of the full transform, sorted.
+ * @param count The number of requested bins.
+ * @param needed Preallocated array of at least fft_pruned_size(n, count)
+ * integers to store the front half index of each needed butterfly in.
+ * @return int The number of butterflies stored in needed, or -1 if all of them
+ * are needed and nothing was stored.
  */
-typedef struct fft_buffer_s *fft_buffer;
+int fft_pruned_butterflies(int64_t n, int64_t bins[], int count,
+                           int64_t needed[]);
 
 /**
- * @brief Creates a sentinel node for a fft_buffer. The fft_buffer operations
- * assume this empty head node always exists.
+ * @brief Calculates how many integers the needed array of a pruned transform
+ * of up to size n must hold, so it can be reserved ahead of time.
  *
- * @return fft_buffer* Sentinel root node for a fft_buffer.
+ * @param n The largest butterfly size that will be pruned.
+ * @param count The number of requested bins.
+ * @return int64_t The number of integers needed.
  */
-fft_buffer fft_buffer_init();
+int64_t fft_pruned_size(int64_t n, int count);
 
 /**
- * @brief Adds entry into a fft_buffer. Performs a deep copy.
+ * @brief Same as fft_butterfly() but only does the butterflies found by
+ * fft_pruned_butterflies(). The rest of the results are left in an undefined
+ * state.
  *
- * @param buf fft_buffer to add entry to.
- * @param x Array of complex numbers, will be deep copied.
- * @param n Size of array.
+ * @param X Dataset to perform butterfly operation on, will be overwritten and
+ * must be a power of two in size. May be any aligned block of the full
+ * transform.
+ * @param n The size of the butterfly operation/input set.
+ * @param inverse If true perform the inverse FFT operation, otherwise the
+ * forward FFT is used.
+ * @param needed The butterflies to do, from fft_pruned_butterflies().
+ * @param butterflies The number of butterflies in needed, -1 for all of them.
  */
-void fft_buffer_add(fft_buffer buf, double complex *x, int n);
+void fft_butterfly_pruned(double complex X[], int64_t n, bool inverse,
+                          int64_t needed[], int butterflies);
 
 /**
- * @brief Searches the given fft_buffer for an entry of size n. Returns pointer
- * to beginning of array if it does exist, NULL if it does not exist. Does not
- * remove entry from buffer.
+ * @brief Same as fft() but skips every butterfly that does not feed one of the
+ * requested output bins of the full transform. Only the values at each bin
+ * modulo n are valid afterwards, which is all the following merges need.
  *
- * @param buf fft_buffer to search through.
- * @param n Entry size to search for, due to the nature of the FFT there should
- * never be duplicate sizes but if there are it will return the first one found.
- * @return double* Array of values for the given size if found, NULL if not
- * found.
+ * @param X The input set of complex numbers, must be a power of two in size,
+ * and will be overwritten by the results. May be any aligned block of the full
+ * transform.
+ * @param n The size of the input set.
+ * @param inverse If true perform the inverse FFT operation, otherwise the
+ * forward FFT is used.
+ * @param bins The requested output bins of the full transform, sorted.
+ * @param count The number of requested bins.
+ * @param needed Preallocated array of at least fft_pruned_size(n, count)
+ * integers used to find the butterflies of each stage.
  */
-double complex *fft_buffer_search(fft_buffer buf, int n);
+void fft_pruned(double complex X[], int64_t n, bool inverse, int64_t bins[],
+                int count, int64_t needed[]);
 
 /**
- * @brief Frees all of the memory associated with an fft_buffer and reassigns
- * pointer to NULL.
+ * @brief A single decimation-in-frequency butterfly operation, the counterpart
+ * of fft_butterfly(). Used to split a set into two independent halves that can
+ * be transformed separately.
  *
- * @param root fft_buffer to free memory from.
+ * @param X Dataset to perform butterfly operation on, in natural order. Will be
+ * overwritten and must be a power of two in size.
+ * @param n The size of the butterfly operation/input set.
+ * @param inverse If true perform the inverse FFT operation, otherwise the
+ * forward FFT is used.
+ */
+void fft_dif_butterfly(double complex X[], int64_t n, bool inverse);
+
+/**
+ * @brief Decimation-in-frequency FFT. Takes its input in natural order and
+ * leaves the results in bit reversal permutation order, so that following it
+ * with the fft() of the opposite direction needs no bit reversal permutation at
+ * all. Used for convolution where the order of the spectrum does not matter.
+ *
+ * @param X The input set of complex numbers, must be a power of two in size,
+ * and will be overwritten by the results.
+ * @param n The size of the input set.
+ * @param inverse If true perform the inverse FFT operation, otherwise the
+ * forward FFT is used.
  */
-void fft_buffer_free(fft_buffer *root);
+void fft_dif(double complex X[], int64_t n, bool inverse);
 
 #endif  // FFT_H_INCLUDED
@@ -4,13 +4,36 @@
 /**
  * @brief This file encapsulates all of the messaging needed by the program.
  * This program was designed with MPI in mind but all of the MPI code was
- * isolated to these functions.
+ * isolated to these functions. Sizes are 64-bit, messages too large for an MPI
+ * count are sent as a single element of a derived datatype.
  *
  */
 #ifndef MESSAGING_H_INCLUDED
 #define MESSAGING_H_INCLUDED
 
 #include <complex.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Results sent between data nodes are split into chunks of at least
+// RESULT_CHUNK_MIN elements, and into no more than RESULT_CHUNK_MAX chunks.
+#define RESULT_CHUNK_MIN (1 << 14)
+#define RESULT_CHUNK_MAX 64
+
+/**
+ * @brief A set of outstanding non-blocking operations. Members never need to be
+ * accessed directly, consider it an opaque handle.
+ *
+ */
+typedef struct msg_requests_s *msg_requests;
+
+/**
+ * @brief The nodes on the same host as the current one and a buffer they all
+ * share. Members never need to be accessed directly, consider it an opaque
+ * handle.
+ *
+ */
+typedef struct shared_region_s *shared_region;
 
 /**
  * @brief Wrapper around MPI_Init and MPI_Comm_rank. Here so mpi.h does not need
@@ -31,6 +54,38 @@ int msg_init(int *argc, char **argv[]);
  */
 int get_node_count();
 
+/**
+ * @brief Get the ID number of the current node.
+ *
+ * @return The rank of the current node.
+ */
+int get_node_id();
+
+/**
+ * @brief Wrapper around MPI_Wtime, so timings use the same clock as messages.
+ *
+ * @return double Seconds since some point in the past.
+ */
+double get_time();
+
+/**
+ * @brief Measures the link to another node by sending messages back and forth,
+ * the other node must call echo_link() at the same time.
+ *
+ * @param peer The ID number of the node to measure the link to.
+ * @param latency Variable to store the seconds any message takes in.
+ * @param element_time Variable to store the seconds each element in a message
+ * adds in.
+ */
+void measure_link(int peer, double *latency, double *element_time);
+
+/**
+ * @brief The other side of measure_link(), sends every message straight back.
+ *
+ * @param peer The ID number of the node measuring the link.
+ */
+void echo_link(int peer);
+
 /**
  * @brief Packages and sends the initial headers to all other nodes in the
  * system. The input arrays are expected to be parallel and each index
@@ -43,7 +98,8 @@ int get_node_count();
  * @param result_dest The destination node for the result from each node.
  * @param nodes The total number of nodes, not counting the head node.
  */
-void send_headers(int parts[], int result_size[], int result_dest[], int nodes);
+void send_headers(int64_t parts[], int64_t result_size[], int result_dest[],
+                  int nodes);
 
 /**
  * @brief Receives the initial header from the head node. These variables are
@@ -56,26 +112,71 @@ void send_headers(int parts[], int result_size[], int result_dest[], int nodes);
  * @param result_dest The node that will store the node the result should be
  * sent to.
  */
-void recv_header(int *subset_size, int *result_size, int *result_dest);
+void recv_header(int64_t *subset_size, int64_t *result_size,
+                 int *result_dest);
+
+/**
+ * @brief Finds out which host every node runs on. Must be called by every node,
+ * only the head node is given the result.
+ *
+ * @param hosts Array to store the host of each node in, any two nodes on the
+ * same host get the same value. Only used on the head node.
+ * @param nodes The total number of nodes, not counting the head node.
+ */
+void gather_hosts(int hosts[], int nodes);
 
 /**
- * @brief Sends the initial subsets
+ * @brief Finds the nodes running on the same host as the head node, including
+ * the head node itself. Must be called by every node.
  *
- * @param data The full set of the bit-reversed permutation'd data to be sent
- * out to other nodes.
- * @param parts The list of sizes to be sent to each node respectively.
- * @param nodes The total number of nodes.
+ * @param local_id The integer to store the index of the current node among
+ * them in, -1 if it runs on another host.
+ * @return int The number of nodes on the head node's host.
  */
-void send_init_subsets(double complex data[], int parts[], int nodes);
+int head_host_nodes(int *local_id);
+
+/**
+ * @brief Broadcasts the full communication tree from the head node so that each
+ * node can find out which nodes send results to it and where they go. Must be
+ * called by every node, the arrays are only read on the head node and
+ * overwritten elsewhere.
+ *
+ * @param offsets Where the subset of each node starts in the bit reversal
+ * permutation of the input.
+ * @param result_size The size of the result each respective node is expected to
+ * send.
+ * @param result_dest The destination node for the result from each node.
+ * @param nodes The total number of nodes, not counting the head node.
+ */
+void broadcast_tree(int64_t offsets[], int64_t result_size[],
+                    int result_dest[], int nodes);
+
+/**
+ * @brief Broadcasts a single count from the head node to every node. Must be
+ * called by every node.
+ *
+ * @param count The count to broadcast, only read on the head node.
+ * @return int64_t The count sent by the head node.
+ */
+int64_t broadcast_count(int64_t count);
+
+/**
+ * @brief Sends a node its initial subset, returns once data can be reused.
+ *
+ * @param data The node's subset of the bit-reversed permutation'd data.
+ * @param size The size of the subset.
+ * @param node The node to send it to.
+ */
+void send_init_subset(double complex data[], int64_t size, int node);
 
 /**
  * @brief Receives the inital subset of numbers to perform the FFT on.
  *
  * @param data The buffer to store the incoming data in.
  * @param max The maximum number of elements the incoming data buffer can store.
- * @return int The number of elements actually received.
+ * @return int64_t The number of elements actually received.
  */
-int recv_init_subset(double complex *data, int max);
+int64_t recv_init_subset(double complex *data, int64_t max);
 
 /**
  * @brief Sends the results of the current node to the destination node.
@@ -84,7 +185,7 @@ int recv_init_subset(double complex *data, int max);
  * @param size The number of elements in the result data set.
  * @param dest The ID number of the node to send the result data set to.
  */
-void send_results(double complex *data, int size, int dest);
+void send_results(double complex *data, int64_t size, int dest);
 
 /**
  * @brief Receives a result set from another node. There are no guarantees about
@@ -92,9 +193,172 @@ void send_results(double complex *data, int size, int dest);
  *
  * @param data Pointer to buffer for holding the incoming data.
  * @param max The maximum amount the incoming data buffer can hold.
- * @return int The number of elements actually received.
+ * @return int64_t The number of elements actually received.
+ */
+int64_t recv_result_set(double complex *data, int64_t max);
+
+/**
+ * @brief Sends a reduced result, such as a power spectrum, in place of the full
+ * complex result set.
+ *
+ * @param data The reduced result to be sent.
+ * @param size The number of doubles in the reduced result.
+ * @param dest The ID number of the node to send the reduced result to.
+ */
+void send_reduced(double *data, int64_t size, int dest);
+
+/**
+ * @brief Receives a reduced result from another node.
+ *
+ * @param data Pointer to buffer for holding the incoming data.
+ * @param max The maximum amount the incoming data buffer can hold.
+ * @return int64_t The number of doubles actually received.
+ */
+int64_t recv_reduced(double *data, int64_t max);
+
+/**
+ * @brief Sends a partially transformed block down the communication tree, used
+ * by the decimation-in-frequency pass where data flows from the destination of
+ * a result back to the node it came from.
+ *
+ * @param data The block to be sent.
+ * @param size The number of elements in the block.
+ * @param dest The ID number of the node to send the block to.
+ */
+void send_dif_block(double complex *data, int64_t size, int dest);
+
+/**
+ * @brief Receives a partially transformed block from the given node.
+ *
+ * @param data Pointer to buffer for holding the incoming data.
+ * @param max The maximum amount the incoming data buffer can hold.
+ * @param source The ID number of the node the block is coming from.
+ * @return int64_t The number of elements actually received.
+ */
+int64_t recv_dif_block(double complex *data, int64_t max, int source);
+
+/**
+ * @brief Calculates how many chunks a result of the given size is sent in, both
+ * the sender and the receiver need to agree on this.
+ *
+ * @param size The number of elements in the result.
+ * @return int The number of chunks, each the same size.
+ */
+int result_chunk_count(int64_t size);
+
+/**
+ * @brief Creates an empty set of outstanding operations.
+ *
+ * @param count The number of operations the set can hold.
+ * @return msg_requests The new set of operations.
+ */
+msg_requests msg_requests_init(int count);
+
+/**
+ * @brief Starts sending one chunk of a result, the data must not be modified
+ * until the operation completes.
+ *
+ * @param reqs The set of operations to track the send in.
+ * @param index The index in reqs to track the send at.
+ * @param data The chunk to be sent.
+ * @param size The number of elements in the chunk.
+ * @param dest The ID number of the node to send the chunk to.
+ * @param chunk Which chunk of the result this is.
+ */
+void send_chunk_async(msg_requests reqs, int index, double complex *data,
+                      int64_t size, int dest, int chunk);
+
+/**
+ * @brief Posts a receive for one chunk of a result from the given node, the
+ * data must not be touched until the operation completes.
+ *
+ * @param reqs The set of operations to track the receive in.
+ * @param index The index in reqs to track the receive at.
+ * @param data The buffer the chunk will be received into.
+ * @param size The number of elements in the chunk.
+ * @param source The ID number of the node sending the chunk.
+ * @param chunk Which chunk of the result this is.
+ */
+void recv_chunk_async(msg_requests reqs, int index, double complex *data,
+                      int64_t size, int source, int chunk);
+
+/**
+ * @brief Waits for any one of the outstanding operations to complete.
+ *
+ * @param reqs The set of operations to wait on.
+ * @return int The index of the operation that completed, -1 if none were left.
+ */
+int wait_any_request(msg_requests reqs);
+
+/**
+ * @brief Waits for every outstanding operation to complete.
+ *
+ * @param reqs The set of operations to wait on.
+ */
+void wait_all_requests(msg_requests reqs);
+
+/**
+ * @brief Frees a set of operations and reassigns the pointer to NULL, every
+ * operation in it must have completed.
+ *
+ * @param reqs The set of operations to free.
+ */
+void msg_requests_free(msg_requests *reqs);
+
+/**
+ * @brief Finds the other nodes running on the same host as the current one.
+ * Must be called by every node, including those that do not join.
+ *
+ * @param join If false the current node takes no part in sharing memory.
+ * @return shared_region The nodes on this host that joined, NULL if the current
+ * node did not join.
+ */
+shared_region shared_region_init(bool join);
+
+/**
+ * @brief Checks whether a node joined the same shared region as the current
+ * one.
+ *
+ * @param shm The shared region, may be NULL in which case no node is local.
+ * @param node The ID number of the node to check.
+ * @return true if the node can see the region's buffer.
+ */
+bool shared_region_local(shared_region shm, int node);
+
+/**
+ * @brief Allocates the buffer shared by every node in the region, made of one
+ * segment from each node in rank order. Must be called by every node in the
+ * region.
+ *
+ * @param shm The shared region.
+ * @param size The number of elements in the current node's segment.
+ * @return double complex* The start of the buffer, the same memory on every
+ * node in the region.
+ */
+double complex *shared_region_alloc(shared_region shm, int64_t size);
+
+/**
+ * @brief Makes writes to the shared buffer visible to the other nodes in the
+ * region. The writer has to call this before telling another node its data is
+ * ready, and the reader after being told.
+ *
+ * @param shm The shared region.
+ */
+void shared_region_sync(shared_region shm);
+
+/**
+ * @brief Frees the shared region and its buffer and reassigns the pointer to
+ * NULL. Must be called by every node in the region.
+ *
+ * @param shm The shared region to free, nothing is done if it is NULL.
+ */
+void shared_region_free(shared_region *shm);
+
+/**
+ * @brief Stub function calling MPI_Barrier(), waits until every node gets here.
+ *
  */
-int recv_result_set(double complex *data, int max);
+void msg_barrier();
 
 /**
  * @brief Stub function calling MPI_Barrier() and then MPI_Finalize(), does not
@@ -5,6 +5,11 @@
 #define NODE_H_INCLUDED
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "reduce.h"
+#include "tree.h"
 
 /**
  * @brief This function contains all of the responsibilities of the head node,
@@ -14,8 +19,19 @@
  * @param header If true the first line of the input file will be ignored.
  * @param inverse If true perform the inverse FFT operation, otherwise the
  * forward FFT is used.
+ * @param reduce Reduction applied to the spectrum before it is sent back, the
+ * reduced result is printed instead of the spectrum.
+ * @param bins Sorted output bins to compute, only these are printed.
+ * @param bincount Number of output bins, if 0 every bin is computed.
+ * @param pages The kind of pages to back the node's buffers with, the input is
+ * read into normal memory.
+ * @param shared If true data nodes on the same host share their buffers, must
+ * match the data nodes.
+ * @param tree How to build the communication tree, must match the data nodes.
  */
-void head_node(const char* filename, bool header, bool inverse);
+void head_node(const char* filename, bool header, bool inverse,
+               struct reduction reduce, int64_t bins[], int bincount,
+               enum arena_pages pages, bool shared, struct tree_options tree);
 
 /**
  * @brief This function contains the routines to be ran by all other nodes.
@@ -23,7 +39,65 @@ void head_node(const char* filename, bool header, bool inverse);
  *
  *  @param inverse If true perform the inverse FFT operation, otherwise the
  * forward FFT is used.
+ * @param reduce Reduction applied by the last node in the communication tree
+ * before its result is sent to the head node.
+ * @param bins Sorted output bins to compute, butterflies that do not feed them
+ * are skipped.
+ * @param bincount Number of output bins, if 0 every bin is computed.
+ * @param pages The kind of pages to back the node's buffers with.
+ * @param shared If true nodes on the same host work in one shared buffer and
+ * only tell each other when a result is ready instead of sending it.
+ * @param tree How the head node builds the communication tree.
+ */
+void data_node(bool inverse, struct reduction reduce, int64_t bins[],
+               int bincount, enum arena_pages pages, bool shared,
+               struct tree_options tree);
+
+/**
+ * @brief The head node's side of convolution or correlation. Reads both the
+ * signal and kernel, sends them down the communication tree one block at a time
+ * and prints the linear convolution of the two. Long signals are split into
+ * blocks with overlap-save.
+ *
+ * @param filename The name of the input signal file.
+ * @param kernelname The name of the kernel file.
+ * @param header If true the first line of both input files will be ignored.
+ * @param correlate If true compute the cross-correlation instead, the output
+ * then starts at the most negative lag.
+ * @param block_size The transform size used for overlap-save, must be a power
+ * of two no smaller than the kernel. If 0 a single transform large enough for
+ * the whole output is used.
+ * @param pages The kind of pages to back the block buffer with.
+ * @param tree How to build the communication tree, must match the data nodes.
+ */
+void convolve_head_node(const char* filename, const char* kernelname,
+                        bool header, bool correlate, int64_t block_size,
+                        enum arena_pages pages, struct tree_options tree);
+
+/**
+ * @brief The routine ran by all other nodes for convolution or correlation. The
+ * forward transforms are done with decimation-in-frequency down the
+ * communication tree, multiplied where they land, and transformed back with
+ * the usual decimation-in-time merges so no bit reversal is ever needed.
+ *
+ * @param pages The kind of pages to back the node's buffers with.
+ * @param tree How the head node builds the communication tree.
+ */
+void convolve_data_node(enum arena_pages pages, struct tree_options tree);
+
+/**
+ * @brief The routine ran by every node for an out-of-core transform. The input
+ * and output are binary files on the head node's disk, the nodes on its host
+ * split each pass between them and every other node sits it out.
+ *
+ * @param inname The name of the binary input file.
+ * @param outname The name of the binary output file.
+ * @param memory The most bytes each node's buffers may take up.
+ * @param inverse If true perform the inverse FFT operation, otherwise the
+ * forward FFT is used.
+ * @param pages The kind of pages to back the node's buffers with.
  */
-void data_node(bool inverse);
+void out_of_core_node(const char* inname, const char* outname, size_t memory,
+                      bool inverse, enum arena_pages pages);
 
 #endif  // NODE_H_INCLUDED
\ No newline at end of file
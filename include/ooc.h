@@ -0,0 +1,125 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+/**
+ * @brief Out-of-core transforms of signals too large to fit in memory. The
+ * signal is kept in a binary file on disk, one complex number after another as
+ * the native double real part followed by the double imaginary part with no
+ * header, and viewed as a matrix of R rows and C columns where N = R * C. The
+ * four-step decomposition then transforms it in two passes over the disk:
+ * - FFT each column of the input, multiply by the twiddle factors and write
+ *   each column out as a row of a temporary file.
+ * - FFT each column of the temporary file and write each one out as a column
+ *   of the output.
+ * Columns are streamed through a few buffers in blocks sized to fit a memory
+ * cap, the next block is read and the last one written while the current one
+ * is transformed. Everything a plan needs, including the state of its reads
+ * and writes, comes out of that cap.
+ *
+ */
+#ifndef OOC_H_INCLUDED
+#define OOC_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define OOC_PASSES 2
+#define OOC_DEFAULT_MEMORY 256  // In MiB
+
+/**
+ * @brief Opaque handle to an out-of-core plan, members never need to be
+ * accessed directly.
+ *
+ */
+typedef struct ooc_plan_s *ooc_plan;
+
+/**
+ * @brief Calculates the size of the transform of a binary file, the number of
+ * values in it padded with zeros to a power of two. The minimum size is 4.
+ *
+ * @param filename The name of the binary file.
+ * @return int64_t The size of the transform, -1 if the file could not be read.
+ */
+int64_t ooc_size(const char *filename);
+
+/**
+ * @brief Creates the output file and the temporary file of a transform at
+ * their full size, overwriting them if they exist. Must be done by a single
+ * node before any of them call ooc_init().
+ *
+ * @param outname The name of the output file, the temporary file is the same
+ * with ".tmp" appended.
+ * @param N The size of the transform.
+ * @return int 0 on success, -1 if either file could not be created.
+ */
+int ooc_create(const char *outname, int64_t N);
+
+/**
+ * @brief Removes the temporary file of a transform once every node is done
+ * with it.
+ *
+ * @param outname The name of the output file.
+ */
+void ooc_remove(const char *outname);
+
+/**
+ * @brief Plans an out-of-core transform and reserves its buffers. Blocks are
+ * the largest power of two number of columns for which every buffer and the
+ * requests moving them fit in the memory cap.
+ *
+ * @param inname The name of the binary input file.
+ * @param outname The name of the output file, already created by ooc_create().
+ * @param memory The most bytes the buffers may take up.
+ * @param inverse If true perform the inverse FFT, otherwise the forward FFT.
+ * @param pages The kind of pages to back the buffers with.
+ * @return ooc_plan The new plan, NULL if a file could not be opened, the
+ * buffers could not be reserved or the memory cap is too small for a single
+ * column.
+ */
+ooc_plan ooc_init(const char *inname, const char *outname, size_t memory,
+                  bool inverse, enum arena_pages pages);
+
+/**
+ * @brief Gets the shape of a transform.
+ *
+ * @param plan The plan of the transform.
+ * @param rows The integer to store the number of rows R in.
+ * @param columns The integer to store the number of columns C in.
+ */
+void ooc_shape(ooc_plan plan, int64_t *rows, int64_t *columns);
+
+/**
+ * @brief Gets how many blocks of columns a pass is done in.
+ *
+ * @param plan The plan of the transform.
+ * @param pass The pass, from 0 to OOC_PASSES - 1.
+ * @param width The integer to store the number of columns in each block in.
+ * @return int64_t The number of blocks.
+ */
+int64_t ooc_blocks(ooc_plan plan, int pass, int64_t *width);
+
+/**
+ * @brief Does the blocks first, first + step, first + 2 * step and so on of a
+ * pass, so that several nodes can split a pass between them. Every node must
+ * finish a pass before any starts the next.
+ *
+ * @param plan The plan of the transform.
+ * @param pass The pass, from 0 to OOC_PASSES - 1.
+ * @param first The first block to do.
+ * @param step The distance between blocks.
+ * @return int 0 on success, -1 if reading or writing failed.
+ */
+int ooc_pass(ooc_plan plan, int pass, int64_t first, int64_t step);
+
+/**
+ * @brief Closes the files of a plan, frees its buffers and reassigns the
+ * handle to NULL.
+ *
+ * @param plan The plan to free.
+ */
+void ooc_free(ooc_plan *plan);
+
+#endif  // OOC_H_INCLUDED
@@ -6,13 +6,31 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "ooc.h"
+#include "reduce.h"
+#include "tree.h"
 
 struct breakwater_options {
   char *infilename;
+  char *kernelfilename;
+  char *outfilename;
   int loglvl;
   int style;
   bool header;
   bool inverse;
+  bool correlate;
+  int64_t blocksize;
+  struct reduction reduce;
+  int64_t *bins;
+  int bincount;
+  int leafsize;
+  enum arena_pages pages;
+  bool shared;
+  struct tree_options tree;
+  size_t memory;
   bool use_lut;
 };
 
@@ -0,0 +1,61 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+/**
+ * @brief Reductions that can be applied to a finished spectrum before it is
+ * sent to the head node, so that only the reduced result crosses the network.
+ * Nothing here allocates, every reduction works within the output it is given.
+ *
+ */
+#ifndef REDUCE_H_INCLUDED
+#define REDUCE_H_INCLUDED
+
+#include <complex.h>
+#include <stdint.h>
+
+enum reduction_type {
+  REDUCE_NONE,       // Send the full complex spectrum
+  REDUCE_MAGNITUDE,  // |X|
+  REDUCE_POWER,      // |X|^2
+  REDUCE_DECIBEL,    // 10 log10 |X|^2
+  REDUCE_BANDS,      // Sum of |X|^2 over bands of param bins
+  REDUCE_PEAKS       // The param bins with the highest |X|^2
+};
+
+struct reduction {
+  enum reduction_type type;
+  int param;
+};
+
+/**
+ * @brief Calculates how many doubles the reduced form of a spectrum takes.
+ *
+ * @param reduce The reduction to be applied.
+ * @param N The size of the spectrum.
+ * @return int64_t Number of doubles needed to store the reduced spectrum.
+ */
+int64_t reduced_size(struct reduction reduce, int64_t N);
+
+/**
+ * @brief Applies a reduction to a finished spectrum. Peaks are stored as
+ * triples of bin, real and imaginary parts in order of decreasing power.
+ *
+ * @param X The spectrum, will not be modified.
+ * @param N The size of the spectrum.
+ * @param reduce The reduction to be applied.
+ * @param out Preallocated array of reduced_size() doubles to store the result
+ * in.
+ */
+void reduce_spectrum(double complex X[], int64_t N, struct reduction reduce,
+                     double out[]);
+
+/**
+ * @brief Prints out a reduced spectrum, one value or peak on each line.
+ *
+ * @param out The reduced spectrum.
+ * @param size The number of doubles in the reduced spectrum.
+ * @param reduce The reduction that produced it.
+ */
+void print_reduced(double out[], int64_t size, struct reduction reduce);
+
+#endif  // REDUCE_H_INCLUDED
@@ -0,0 +1,162 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+/**
+ * @brief Builds communication trees that take the layout of the system into
+ * account, and models what a given tree costs. Every array here is indexed by
+ * node like the ones from result_targets(), index i holding node i + 1.
+ * Nothing here sends messages, print_tree() and read_host_hints() are the only
+ * functions that do any I/O.
+ *
+ */
+#ifndef TREE_H_INCLUDED
+#define TREE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief The modeled cost of a communication tree, work is counted in
+ * butterflies and transfers in elements.
+ *
+ */
+struct tree_cost {
+  int cross_transfers;     // Results sent between hosts
+  int64_t cross_elements;  // Elements sent between hosts
+  int local_transfers;     // Results sent within a host
+  int64_t local_elements;  // Elements sent within a host
+  int64_t max_work;        // Most butterflies done by a single node
+  int64_t critical_path;   // Butterflies on the longest chain of dependencies
+};
+
+/**
+ * @brief Measured costs used to model how long a transform takes.
+ *
+ */
+struct cost_model {
+  double latency;         // Seconds for any message to arrive
+  double element_time;    // Seconds for each element in a message
+  double butterfly_time;  // Seconds for a single butterfly
+};
+
+/**
+ * @brief How the communication tree should be built.
+ *
+ */
+struct tree_options {
+  bool topology;         // Use topology_targets() instead of result_targets()
+  const char *hostfile;  // Hints for which host each node runs on, or NULL
+  bool dry_run;          // Only print the tree and its cost
+  bool auto_size;        // Let pick_node_count() decide which nodes take part
+};
+
+/**
+ * @brief Calculates where each node's subset starts in the bit reversal
+ * permutation of the input when subsets are handed out in node order, as
+ * result_targets() expects.
+ *
+ * @param offsets Preallocated array to store the start of each subset in.
+ * @param parts The size of each node's subset.
+ * @param nodes The total number of nodes, not counting the head node.
+ */
+void subset_offsets(int64_t offsets[], int64_t parts[], int nodes);
+
+/**
+ * @brief Builds a communication tree that keeps as many merges on the same
+ * host as possible. Subsets are handed out so that the nodes of each host get
+ * neighbouring ones, then the node that receives each merge is picked to first
+ * minimize the number of results sent between hosts, then the number of
+ * elements sent between them, and finally to spread the merge work over the
+ * nodes. The result of a node covers the aligned block of its own size
+ * containing its subset, and either half of a merge may be the one received.
+ *
+ * @param N Total number of values to be operated on, must be a power of two.
+ * @param active How many of the nodes take part, the rest are left without a
+ * subset.
+ * @param parts Preallocated array to store the size of each node's subset in.
+ * @param offsets Preallocated array to store the start of each node's subset
+ * in the bit reversal permutation of the input.
+ * @param result_size Preallocated array to store the size of the result each
+ * node sends in, 0 for nodes left without a subset.
+ * @param result_dest Preallocated array to store the destination of each
+ * node's result in, 0 being the head node.
+ * @param hosts Which host each node runs on, any value can be used as long as
+ * nodes on the same host have the same one.
+ * @param nodes The total number of nodes, not counting the head node.
+ */
+void topology_targets(int64_t N, int active, int64_t parts[],
+                      int64_t offsets[], int64_t result_size[],
+                      int result_dest[], int hosts[], int nodes);
+
+/**
+ * @brief Models the cost of a communication tree.
+ *
+ * @param cost Struct to store the cost in.
+ * @param parts The size of each node's subset.
+ * @param result_size The size of the result each node sends.
+ * @param result_dest The destination of each node's result.
+ * @param hosts Which host each node runs on.
+ * @param nodes The total number of nodes, not counting the head node.
+ */
+void tree_cost(struct tree_cost *cost, int64_t parts[], int64_t result_size[],
+               int result_dest[], int hosts[], int nodes);
+
+/**
+ * @brief Models how long a transform of size N takes when the subsets are
+ * spread over the given number of nodes with result_targets(). Covers sending
+ * out the subsets, the longest chain of butterflies, the results merged along
+ * it and sending the result back to the head node.
+ *
+ * @param N Total number of values to be operated on, must be a power of two.
+ * @param active The number of nodes taking part, 0 meaning the head node does
+ * the whole transform by itself.
+ * @param model The measured costs.
+ * @return double The modeled time in seconds.
+ */
+double model_time(int64_t N, int active, struct cost_model model);
+
+/**
+ * @brief Picks how many nodes should take part in a transform of size N, the
+ * count with the lowest model_time(). Ties go to fewer nodes.
+ *
+ * @param N Total number of values to be operated on, must be a power of two.
+ * @param nodes The total number of nodes, not counting the head node.
+ * @param model The measured costs.
+ * @param serial If true 0 can be picked, meaning the head node does the whole
+ * transform by itself.
+ * @return int The number of nodes that should take part.
+ */
+int pick_node_count(int64_t N, int nodes, struct cost_model model,
+                    bool serial);
+
+/**
+ * @brief Prints out a communication tree, one node per line as node, host,
+ * subset size, subset offset, result size and destination, followed by its
+ * modeled cost.
+ *
+ * @param parts The size of each node's subset.
+ * @param offsets The start of each node's subset.
+ * @param result_size The size of the result each node sends.
+ * @param result_dest The destination of each node's result.
+ * @param hosts Which host each node runs on.
+ * @param nodes The total number of nodes, not counting the head node.
+ */
+void print_tree(int64_t parts[], int64_t offsets[], int64_t result_size[],
+                int result_dest[], int hosts[], int nodes);
+
+/**
+ * @brief Reads which host each node runs on from a file instead of detecting
+ * it. Either an Open MPI style rankfile with lines like "rank 3=host2 slot=0",
+ * or a hostfile with lines like "host2 slots=4" where ranks are handed out to
+ * each host in order until its slots are filled. Hosts in a hostfile without
+ * a slot count get one slot. The head node is rank 0 in both.
+ *
+ * @param filename The name of the file to read.
+ * @param hosts Preallocated array to store the host of each node in.
+ * @param nodes The total number of nodes, not counting the head node.
+ * @return int 0 on success, -1 if the file could not be read or does not place
+ * every node.
+ */
+int read_host_hints(const char *filename, int hosts[], int nodes);
+
+#endif  // TREE_H_INCLUDED
@@ -0,0 +1,82 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+#define _GNU_SOURCE  // MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct arena_s {
+  char *base;
+  size_t size;
+  size_t used;
+  enum arena_pages pages;
+};
+
+static size_t page_size(enum arena_pages pages) {
+  return pages == ARENA_PAGES_NORMAL ? sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+}
+
+arena arena_init(size_t size, enum arena_pages pages) {
+  size_t page = page_size(pages);
+  size = (size + page - 1) / page * page;
+  if (size == 0) size = page;
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+  if (pages == ARENA_PAGES_HUGE) flags |= MAP_HUGETLB;
+#else
+  if (pages == ARENA_PAGES_HUGE)
+    return arena_init(size, ARENA_PAGES_TRANSPARENT);
+#endif  // MAP_HUGETLB
+  char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (base == MAP_FAILED) {
+    // Explicit huge pages only exist if the OS set some aside
+    if (pages == ARENA_PAGES_HUGE)
+      return arena_init(size, ARENA_PAGES_TRANSPARENT);
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (pages == ARENA_PAGES_TRANSPARENT) madvise(base, size, MADV_HUGEPAGE);
+#endif  // MADV_HUGEPAGE
+
+  // First touch, each page is placed on the NUMA node of whoever writes it.
+  // Transparent huge pages are not guaranteed, so every normal page is touched.
+  size_t stride = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < size; i += stride) base[i] = 0;
+
+  arena mem = malloc(sizeof(struct arena_s));
+  mem->base = base;
+  mem->size = size;
+  mem->used = 0;
+  mem->pages = pages;
+  return mem;
+}
+
+enum arena_pages arena_page_kind(arena mem) { return mem->pages; }
+
+size_t arena_fit(size_t limit, enum arena_pages pages) {
+  return limit / page_size(pages) * page_size(pages);
+}
+
+size_t arena_size(size_t size) { return size + ARENA_ALIGNMENT - 1; }
+
+void *arena_alloc(arena mem, size_t size) {
+  uintptr_t start = (uintptr_t)(mem->base + mem->used);
+  size_t padding = (ARENA_ALIGNMENT - start % ARENA_ALIGNMENT) %
+                   ARENA_ALIGNMENT;
+  if (mem->used + padding + size > mem->size) return NULL;
+  mem->used += padding + size;
+  return (void *)(start + padding);
+}
+
+void arena_free(arena *mem) {
+  munmap((*mem)->base, (*mem)->size);
+  free(*mem);
+  *mem = NULL;
+}
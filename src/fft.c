@@ -14,53 +14,176 @@
 #include <string.h>
 
 #include "bitmanip.h"
+#include "codelets.h"
 
-void print_complex(double complex *x, int N) {
-  for (int i = 0; i < N; i++) printf("%f,%f\n", creal(x[i]), cimag(x[i]));
+// Size of the blocks handled by a codelet before the general butterflies take
+// over, a power of two no larger than MAX_CODELET_SIZE.
+static int leaf_size = DEFAULT_LEAF_SIZE;
+
+void print_complex(double complex *x, int64_t N) {
+  for (int64_t i = 0; i < N; i++) printf("%f,%f\n", creal(x[i]), cimag(x[i]));
 }
 
 // These four functions are written out explicitly for maximum performance!
-void forward_fft_butterfly(double complex X[], int n) {
-  for (int j = 0; j < n / 2; j++) {
+void forward_fft_butterfly(double complex X[], int64_t n) {
+  for (int64_t j = 0; j < n / 2; j++) {
     double complex product = cexp(-(I * M_TAU * j) / n) * X[j + n / 2];
     X[j + n / 2] = X[j] - product;
     X[j] = X[j] + product;
   }
 }
 
-void forward_fft(double complex X[], int N) {
-  for (int j = 2; j <= N; j *= 2)
-    for (int k = 0; k < N; k += j) forward_fft_butterfly(&X[k], j);
+void forward_fft(double complex X[], int64_t N) {
+  int64_t leaf = leaf_size < N ? leaf_size : N;
+  fft_codelet codelet = forward_codelets[bit_length(leaf) - 1];
+  for (int64_t k = 0; k < N; k += leaf) codelet(&X[k]);
+  for (int64_t j = 2 * leaf; j <= N; j *= 2)
+    for (int64_t k = 0; k < N; k += j) forward_fft_butterfly(&X[k], j);
 }
 
-void inverse_fft_butterfly(double complex X[], int n) {
-  for (int j = 0; j < n / 2; j++) {
+void inverse_fft_butterfly(double complex X[], int64_t n) {
+  for (int64_t j = 0; j < n / 2; j++) {
     double complex product = cexp((I * M_TAU * j) / n) * X[j + n / 2];
     X[j + n / 2] = X[j] - product;
     X[j] = X[j] + product;
   }
 }
 
-void inverse_fft(double complex X[], int N) {
-  for (int j = 2; j <= N; j *= 2)
-    for (int k = 0; k < N; k += j) inverse_fft_butterfly(&X[k], j);
+void inverse_fft(double complex X[], int64_t N) {
+  int64_t leaf = leaf_size < N ? leaf_size : N;
+  fft_codelet codelet = inverse_codelets[bit_length(leaf) - 1];
+  for (int64_t k = 0; k < N; k += leaf) codelet(&X[k]);
+  for (int64_t j = 2 * leaf; j <= N; j *= 2)
+    for (int64_t k = 0; k < N; k += j) inverse_fft_butterfly(&X[k], j);
+}
+
+// The decimation-in-frequency variants take their input in natural order and
+// leave the result in bit reversal permutation order, the mirror image of the
+// decimation-in-time functions above.
+void forward_fft_dif_butterfly(double complex X[], int64_t n) {
+  for (int64_t j = 0; j < n / 2; j++) {
+    double complex difference = X[j] - X[j + n / 2];
+    X[j] = X[j] + X[j + n / 2];
+    X[j + n / 2] = cexp(-(I * M_TAU * j) / n) * difference;
+  }
+}
+
+void forward_fft_dif(double complex X[], int64_t N) {
+  for (int64_t j = N; j >= 2; j /= 2)
+    for (int64_t k = 0; k < N; k += j) forward_fft_dif_butterfly(&X[k], j);
+}
+
+void inverse_fft_dif_butterfly(double complex X[], int64_t n) {
+  for (int64_t j = 0; j < n / 2; j++) {
+    double complex difference = X[j] - X[j + n / 2];
+    X[j] = X[j] + X[j + n / 2];
+    X[j + n / 2] = cexp((I * M_TAU * j) / n) * difference;
+  }
 }
 
-void fft(double complex X[], int n, bool inverse) {
+void inverse_fft_dif(double complex X[], int64_t N) {
+  for (int64_t j = N; j >= 2; j /= 2)
+    for (int64_t k = 0; k < N; k += j) inverse_fft_dif_butterfly(&X[k], j);
+}
+
+void fft_set_leaf_size(int size) {
+  assert((size & (size - 1)) == 0);  // Must be a power of two
+  assert(size >= 1 && size <= MAX_CODELET_SIZE);
+  leaf_size = size;
+}
+
+void fft(double complex X[], int64_t n, bool inverse) {
   if (inverse)
     inverse_fft(X, n);
   else
     forward_fft(X, n);
 }
 
-void fft_butterfly(double complex X[], int n, bool inverse) {
+void fft_butterfly_range(double complex X[], int64_t n, bool inverse,
+                         int64_t first, int64_t last) {
+  double sign = inverse ? 1 : -1;
+  for (int64_t j = first; j < last; j++) {
+    double complex product = cexp((sign * I * M_TAU * j) / n) * X[j + n / 2];
+    X[j + n / 2] = X[j] - product;
+    X[j] = X[j] + product;
+  }
+}
+
+void fft_butterfly(double complex X[], int64_t n, bool inverse) {
   if (inverse)
     inverse_fft_butterfly(X, n);
   else
     forward_fft_butterfly(X, n);
 }
 
-double complex *csv2cmplx(const char *filename, bool header, int *N) {
+void fft_dif(double complex X[], int64_t n, bool inverse) {
+  if (inverse)
+    inverse_fft_dif(X, n);
+  else
+    forward_fft_dif(X, n);
+}
+
+void fft_dif_butterfly(double complex X[], int64_t n, bool inverse) {
+  if (inverse)
+    inverse_fft_dif_butterfly(X, n);
+  else
+    forward_fft_dif_butterfly(X, n);
+}
+
+static int compare_index(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Every block of size n needs the same butterflies: those at each bin modulo
+// n / 2. Once there are as many bins as butterflies they are all needed.
+int fft_pruned_butterflies(int64_t n, int64_t bins[], int count,
+                           int64_t needed[]) {
+  if (count >= n / 2) return -1;
+  for (int i = 0; i < count; i++) needed[i] = bins[i] & (n / 2 - 1);
+  qsort(needed, count, sizeof(int64_t), compare_index);
+  int unique = 0;
+  for (int i = 0; i < count; i++)
+    if (unique == 0 || needed[unique - 1] != needed[i])
+      needed[unique++] = needed[i];
+  return unique;
+}
+
+int64_t fft_pruned_size(int64_t n, int count) {
+  return count < n / 2 ? count : n / 2;
+}
+
+void fft_butterfly_pruned(double complex X[], int64_t n, bool inverse,
+                          int64_t needed[], int butterflies) {
+  if (butterflies < 0) {
+    fft_butterfly(X, n, inverse);
+    return;
+  }
+  double sign = inverse ? 1 : -1;
+  for (int i = 0; i < butterflies; i++) {
+    int64_t j = needed[i];
+    double complex product = cexp((sign * I * M_TAU * j) / n) * X[j + n / 2];
+    X[j + n / 2] = X[j] - product;
+    X[j] = X[j] + product;
+  }
+}
+
+void fft_pruned(double complex X[], int64_t n, bool inverse, int64_t bins[],
+                int count, int64_t needed[]) {
+  for (int64_t j = 2; j <= n; j *= 2) {
+    int butterflies = fft_pruned_butterflies(j, bins, count, needed);
+    for (int64_t k = 0; k < n; k += j)
+      fft_butterfly_pruned(&X[k], j, inverse, needed, butterflies);
+  }
+}
+
+double complex *csv2cmplx(const char *filename, bool header, int64_t *N) {
+  int64_t len;
+  return csv2cmplx_len(filename, header, &len, N);
+}
+
+double complex *csv2cmplx_len(const char *filename, bool header,
+                              int64_t *len, int64_t *N) {
   FILE *fp = fopen(filename, "r");
   if (fp == NULL) {
     return NULL;
@@ -69,7 +192,7 @@ double complex *csv2cmplx(const char *filename, bool header, int *N) {
   double complex *x = malloc(sizeof(double complex) * INIT_BLOCK_SIZE);
   assert(x != NULL);
   double temp_real, temp_imag;
-  int allocated = INIT_BLOCK_SIZE;
+  int64_t allocated = INIT_BLOCK_SIZE;
   (*N) = 0;
 
   // using fgets means we get the whole line, this is useful if excel wants to
@@ -84,6 +207,7 @@ double complex *csv2cmplx(const char *filename, bool header, int *N) {
     x[(*N)++] = CMPLX(temp_real, temp_imag);
   }
   fclose(fp);
+  (*len) = (*N);
 
   // pad with zeros to next nearest power of two
   while ((*N) < allocated) x[(*N)++] = 0;
@@ -91,16 +215,16 @@ double complex *csv2cmplx(const char *filename, bool header, int *N) {
   return x;
 }
 
-void partition_pow2(int N, int parts[], int nodes) {
+void partition_pow2(int64_t N, int64_t parts[], int nodes) {
   assert((N & (N - 1)) == 0);                  // Must be a power of two
-  memset(parts, 0, nodes * sizeof(int));       // zero out array
+  memset(parts, 0, nodes * sizeof(int64_t));   // zero out array
   int balance = 1 << (bit_length(nodes) - 1);  // pow(2,floor(log2(nodes)))
   if (balance >= (N / 2)) {                    // Everyone gets 2 or 0
     for (int i = 0; i < N / 2; i++) parts[nodes - 1 - i] = 2;
     return;
   }
-  int portion_a = N / balance;       // Only ever need two values
-  int portion_b = portion_a / 2;     // a & b
+  int64_t portion_a = N / balance;    // Only ever need two values
+  int64_t portion_b = portion_a / 2;  // a & b
   int difference = nodes - balance;  // num above a power of two
   // int count_a = balance - difference;  // num of nodes with higher value
   int count_b = 2 * difference;  // num of nodes with lower value
@@ -108,14 +232,14 @@ void partition_pow2(int N, int parts[], int nodes) {
   for (int i = count_b; i < nodes; i++) parts[i] = portion_a;
 }
 
-void result_targets(int result_size[], int result_dest[], int parts[],
+void result_targets(int64_t result_size[], int result_dest[], int64_t parts[],
                     int nodes) {
   int start = 0;
   while (parts[start] == 0) start++;  // not enough work to go around
 
-  memcpy(result_size, parts, sizeof(int) * nodes);
+  memcpy(result_size, parts, sizeof(int64_t) * nodes);
 
-  for (int i = result_size[start]; i <= result_size[nodes - 1]; i *= 2) {
+  for (int64_t i = result_size[start]; i <= result_size[nodes - 1]; i *= 2) {
     for (int j = start; j < nodes - 1; j++) {
       for (int k = j + 1; k < nodes; k++) {
         if (result_size[j] == i && result_size[k] == i) {
@@ -129,15 +253,76 @@ void result_targets(int result_size[], int result_dest[], int parts[],
   result_dest[nodes - 1] = 0;  // return final response to head-node
 }
 
-void bit_reversal_permutation(double complex *x, int N) {
+// Tiles of 2^COBRA_BITS by 2^COBRA_BITS elements, 16 KiB each. In place needs
+// two of them which should still sit comfortably in L2 at worst.
+#define COBRA_BITS 5
+#define COBRA_TILE (1 << COBRA_BITS)
+
+// Index i is split into a | b | c with a and c being COBRA_BITS each, so that
+// B(i) = B(c) | B(b) | B(a). Every c row of each a is read contiguously into a
+// tile and every B(a) row is written out contiguously, so each cache line is
+// only touched once instead of once per element. Reads and writes of block b
+// always go to block B(b), in place the two blocks are loaded together. Out of
+// place the source may be every stride-th value of a larger array.
+static void read_row(double complex *row, const double complex *src,
+                     int64_t start, int64_t stride) {
+  if (stride == 1) {
+    memcpy(row, &src[start], sizeof(row[0]) * COBRA_TILE);
+    return;
+  }
+  for (int64_t k = 0; k < COBRA_TILE; k++) row[k] = src[(start + k) * stride];
+}
+
+static void cobra(double complex *dst, const double complex *src,
+                  int64_t stride, int bl, bool in_place) {
+  int mid_bits = bl - 2 * COBRA_BITS;
+  int high_shift = bl - COBRA_BITS;
+  int64_t reversed[COBRA_TILE];
+  for (int a = 0; a < COBRA_TILE; a++) reversed[a] = bit_reverse(a, COBRA_BITS);
+
+  double complex tile[COBRA_TILE * COBRA_TILE];
+  double complex pair[COBRA_TILE * COBRA_TILE];
+  for (int64_t b = 0; b < ((int64_t)1 << mid_bits); b++) {
+    int64_t rb = mid_bits > 0 ? bit_reverse(b, mid_bits) : 0;
+    if (in_place && rb < b) continue;  // Already done as part of a pair
+    bool paired = in_place && rb != b;
+
+    for (int64_t a = 0; a < COBRA_TILE; a++) {
+      read_row(&tile[reversed[a] * COBRA_TILE], src,
+               a << high_shift | b << COBRA_BITS, stride);
+      if (paired)
+        read_row(&pair[reversed[a] * COBRA_TILE], src,
+                 a << high_shift | rb << COBRA_BITS, stride);
+    }
+
+    for (int c = 0; c < COBRA_TILE; c++) {
+      double complex *row = &dst[reversed[c] << high_shift | rb << COBRA_BITS];
+      for (int ra = 0; ra < COBRA_TILE; ra++)
+        row[ra] = tile[ra * COBRA_TILE + c];
+      if (paired) {
+        row = &dst[reversed[c] << high_shift | b << COBRA_BITS];
+        for (int ra = 0; ra < COBRA_TILE; ra++)
+          row[ra] = pair[ra * COBRA_TILE + c];
+      }
+    }
+  }
+}
+
+void bit_reversal_permutation(double complex *x, int64_t N) {
   assert((N & (N - 1)) == 0);  // Must be a power of two
 
   // Don't forget bit_length is one indexed!
   int bl = bit_length(N) - 1;
 
+  if (bl >= 2 * COBRA_BITS) {
+    cobra(x, x, 1, bl, true);
+    return;
+  }
+
+  // Small enough to fit in cache anyway
   // We can skip the first and last index, they never need to be moved
-  for (int i = 1; i < N - 1; i++) {
-    int ri = bit_reverse(i, bl);
+  for (int64_t i = 1; i < N - 1; i++) {
+    int64_t ri = bit_reverse(i, bl);
     if (i < ri) {
       double complex temp = x[i];
       x[i] = x[ri];
@@ -146,46 +331,16 @@ void bit_reversal_permutation(double complex *x, int N) {
   }
 }
 
-struct fft_buffer_s {
-  double complex *x;
-  int n;
-  struct fft_buffer_s *next;
-};
-
-fft_buffer fft_buffer_init() {
-  fft_buffer buf = malloc(sizeof(struct fft_buffer_s));
-  buf->next = NULL;
-  buf->x = NULL;
-  buf->n = 0;
-  return buf;
-}
-
-void fft_buffer_add(fft_buffer buf, double complex *x, int n) {
-  while (buf->next != NULL) buf = buf->next;  // locate last link
-  buf->next = malloc(sizeof(struct fft_buffer_s));
-  buf = buf->next;  // step into new link
-  buf->next = NULL;
-  buf->n = n;
-  buf->x = malloc(sizeof(double complex) * n);
-  memcpy(buf->x, x, sizeof(double complex) * n);
-}
+void bit_reversal_copy(double complex *dst, const double complex *src,
+                       int64_t n, int64_t stride) {
+  assert((n & (n - 1)) == 0);  // Must be a power of two
+  int bl = bit_length(n) - 1;
 
-double complex *fft_buffer_search(fft_buffer buf, int n) {
-  while (buf->next != NULL) {
-    buf = buf->next;
-    if (buf->n == n) return buf->x;
+  if (bl >= 2 * COBRA_BITS) {
+    cobra(dst, src, stride, bl, false);
+    return;
   }
-  return NULL;
-}
 
-void fft_buffer_free(fft_buffer *root) {
-  fft_buffer buf = (*root)->next;
-  while (buf != NULL) {
-    fft_buffer temp = buf->next;
-    free(buf->x);
-    free(buf);
-    buf = temp;
-  }
-  free((*root));
-  root = NULL;
+  dst[0] = src[0];
+  for (int64_t i = 1; i < n; i++) dst[bit_reverse(i, bl)] = src[i * stride];
 }
@@ -6,6 +6,9 @@
 #include <unistd.h>
 #endif  //_DEBUG
 
+#include <stdlib.h>
+
+#include "fft.h"
 #include "logging.h"
 #include "messaging.h"
 #include "node.h"
@@ -18,6 +21,7 @@ int main(int argc, char* argv[]) {
   process_options(argc, argv, &bopts, node_id);
 
   init_log(node_id, bopts.loglvl);
+  fft_set_leaf_size(bopts.leafsize);
 
 #ifdef _DEBUG
   printf("Node %i waiting 10 seconds for debugger attachment.\n", node_id);
@@ -26,12 +30,26 @@ int main(int argc, char* argv[]) {
 
   log_msg(LOG__INFO, "Starting...");
 
-  if (node_id == 0)
-    head_node(bopts.infilename, bopts.header, bopts.inverse);
+  if (bopts.outfilename != NULL) {
+    out_of_core_node(bopts.infilename, bopts.outfilename, bopts.memory,
+                     bopts.inverse, bopts.pages);
+  } else if (bopts.kernelfilename != NULL) {
+    if (node_id == 0)
+      convolve_head_node(bopts.infilename, bopts.kernelfilename, bopts.header,
+                         bopts.correlate, bopts.blocksize, bopts.pages,
+                         bopts.tree);
+    else
+      convolve_data_node(bopts.pages, bopts.tree);
+  } else if (node_id == 0)
+    head_node(bopts.infilename, bopts.header, bopts.inverse, bopts.reduce,
+              bopts.bins, bopts.bincount, bopts.pages, bopts.shared,
+              bopts.tree);
   else
-    data_node(bopts.inverse);
+    data_node(bopts.inverse, bopts.reduce, bopts.bins, bopts.bincount,
+              bopts.pages, bopts.shared, bopts.tree);
 
   log_msg(LOG__INFO, "Finished!");
+  free(bopts.bins);
   msg_finalize();
   return 0;
 }
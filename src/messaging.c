@@ -3,19 +3,38 @@
 
 #include "messaging.h"
 
+#include <inttypes.h>
+#include <limits.h>
 #include <mpi.h>
+#include <stdlib.h>
 
 #include "logging.h"
 
 #define SEND_HEADER_TAG 5260
 #define SEND_SUBSET_TAG 5261
 #define SEND_RESULT_TAG 5262
+#define SEND_DIF_TAG 5263
+#define SEND_REDUCED_TAG 5264
+#define SEND_PROBE_TAG 5265
+#define SEND_CHUNK_TAG 5300  // Through SEND_CHUNK_TAG + RESULT_CHUNK_MAX - 1
+
+// Link measurements take the fastest of PROBE_REPEATS round trips of an empty
+// message and of PROBE_SIZE elements, after one of each to warm up the
+// connection.
+#define PROBE_SIZE (1 << 15)
+#define PROBE_REPEATS 8
 
 #define HEADER_SIZE 3
 #define SUBSET_SIZE 0
 #define RESULT_SIZE 1
 #define RESULT_DEST 2
 
+// The most elements sent with a plain count, larger messages are described by
+// large_type(). Can be lowered at build time to exercise that path.
+#ifndef MSG_MAX_COUNT
+#define MSG_MAX_COUNT INT_MAX
+#endif  // MSG_MAX_COUNT
+
 int msg_init(int *argc, char **argv[]) {
   MPI_Init(argc, argv);
   int node_id;
@@ -29,71 +48,356 @@ int get_node_count() {
   return nodes;
 }
 
-void send_headers(int parts[], int result_size[], int result_dest[],
+int get_node_id() {
+  int node_id;
+  MPI_Comm_rank(MPI_COMM_WORLD, &node_id);
+  return node_id;
+}
+
+double get_time() { return MPI_Wtime(); }
+
+// Fastest seconds for a message of size elements to go to peer and back.
+static double round_trip(double complex *buffer, int size, int peer) {
+  double fastest = 0;
+  for (int i = 0; i <= PROBE_REPEATS; i++) {
+    double start = MPI_Wtime();
+    MPI_Send(buffer, size, MPI_DOUBLE_COMPLEX, peer, SEND_PROBE_TAG,
+             MPI_COMM_WORLD);
+    MPI_Recv(buffer, size, MPI_DOUBLE_COMPLEX, peer, SEND_PROBE_TAG,
+             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    double elapsed = MPI_Wtime() - start;
+    if (i == 1 || (i > 1 && elapsed < fastest)) fastest = elapsed;
+  }
+  return fastest;
+}
+
+void measure_link(int peer, double *latency, double *element_time) {
+  double complex *buffer = calloc(PROBE_SIZE, sizeof(double complex));
+  double empty = round_trip(buffer, 0, peer);
+  double full = round_trip(buffer, PROBE_SIZE, peer);
+  free(buffer);
+  *latency = empty / 2;
+  *element_time = full > empty ? (full - empty) / 2 / PROBE_SIZE : 0;
+  log_msg(LOG_DEBUG, "Link to node %i: latency %g s, %g s per element.", peer,
+          *latency, *element_time);
+}
+
+void echo_link(int peer) {
+  double complex *buffer = calloc(PROBE_SIZE, sizeof(double complex));
+  for (int size = 0; size <= PROBE_SIZE; size += PROBE_SIZE) {
+    for (int i = 0; i <= PROBE_REPEATS; i++) {
+      MPI_Recv(buffer, size, MPI_DOUBLE_COMPLEX, peer, SEND_PROBE_TAG,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      MPI_Send(buffer, size, MPI_DOUBLE_COMPLEX, peer, SEND_PROBE_TAG,
+               MPI_COMM_WORLD);
+    }
+  }
+  free(buffer);
+}
+
+// MPI counts are ints, so a message of more than MSG_MAX_COUNT elements is sent
+// as one element of a derived datatype made of as many whole blocks of
+// MSG_MAX_COUNT elements as fit followed by the rest. Its type signature is
+// still just size elements of type, so a receive can be shorter than a send.
+// Smaller messages keep type itself and need no derived datatype.
+static MPI_Datatype large_type(int64_t size, MPI_Datatype type, int *count) {
+  if (size <= MSG_MAX_COUNT) {
+    *count = (int)size;
+    return type;
+  }
+
+  MPI_Datatype blocks, large;
+  int64_t rest = size % MSG_MAX_COUNT;
+  MPI_Type_vector((int)(size / MSG_MAX_COUNT), MSG_MAX_COUNT, MSG_MAX_COUNT,
+                  type, &blocks);
+  MPI_Aint lb, extent;
+  MPI_Type_get_extent(type, &lb, &extent);
+  MPI_Type_create_struct(2, (int[]){1, (int)rest},
+                         (MPI_Aint[]){0, (MPI_Aint)(size - rest) * extent},
+                         (MPI_Datatype[]){blocks, type}, &large);
+  MPI_Type_free(&blocks);
+  MPI_Type_commit(&large);
+  *count = 1;
+  return large;
+}
+
+// Derived datatypes can be freed as soon as the operation using them starts.
+static void free_large_type(MPI_Datatype large, MPI_Datatype type) {
+  if (large != type) MPI_Type_free(&large);
+}
+
+static void send_large(const void *data, int64_t size, MPI_Datatype type,
+                       int dest, int tag) {
+  int count;
+  MPI_Datatype large = large_type(size, type, &count);
+  MPI_Send(data, count, large, dest, tag, MPI_COMM_WORLD);
+  free_large_type(large, type);
+}
+
+// Receives up to max elements, returns how many actually arrived.
+static int64_t recv_large(void *data, int64_t max, MPI_Datatype type,
+                          int source, int tag) {
+  int count;
+  MPI_Datatype large = large_type(max, type, &count);
+  MPI_Status status;
+  MPI_Recv(data, count, large, source, tag, MPI_COMM_WORLD, &status);
+  MPI_Count received;
+  MPI_Get_elements_x(&status, large, &received);
+  free_large_type(large, type);
+  return received;
+}
+
+void send_headers(int64_t parts[], int64_t result_size[], int result_dest[],
                   int nodes) {
   for (int node = 1; node <= nodes; node++) {
     log_msg(LOG__INFO, "Sending initial header to node %i.", node);
-    log_msg(LOG_DEBUG, "Header contents: {%i, %i, %i}", parts[node - 1],
-            result_size[node - 1], result_dest[node - 1]);
-    MPI_Send(
-        (int[]){parts[node - 1], result_size[node - 1], result_dest[node - 1]},
-        HEADER_SIZE, MPI_INT, node, SEND_HEADER_TAG, MPI_COMM_WORLD);
+    log_msg(LOG_DEBUG, "Header contents: {%" PRId64 ", %" PRId64 ", %i}",
+            parts[node - 1], result_size[node - 1], result_dest[node - 1]);
+    MPI_Send((int64_t[]){parts[node - 1], result_size[node - 1],
+                         result_dest[node - 1]},
+             HEADER_SIZE, MPI_INT64_T, node, SEND_HEADER_TAG, MPI_COMM_WORLD);
   }
 }
 
-void recv_header(int *subset_size, int *result_size, int *result_dest) {
+void recv_header(int64_t *subset_size, int64_t *result_size,
+                 int *result_dest) {
   MPI_Status status;
-  int header[HEADER_SIZE];
-  MPI_Recv(&header, HEADER_SIZE, MPI_INT, 0, SEND_HEADER_TAG, MPI_COMM_WORLD,
-           &status);
+  int64_t header[HEADER_SIZE];
+  MPI_Recv(&header, HEADER_SIZE, MPI_INT64_T, 0, SEND_HEADER_TAG,
+           MPI_COMM_WORLD, &status);
   log_msg(LOG__INFO, "Inital header received.");
-  log_msg(LOG_DEBUG, "Header contents: {%i, %i, %i}", header[SUBSET_SIZE],
-          header[RESULT_SIZE], header[RESULT_DEST]);
+  log_msg(LOG_DEBUG, "Header contents: {%" PRId64 ", %" PRId64 ", %" PRId64 "}",
+          header[SUBSET_SIZE], header[RESULT_SIZE], header[RESULT_DEST]);
   (*subset_size) = header[SUBSET_SIZE];
   (*result_size) = header[RESULT_SIZE];
-  (*result_dest) = header[RESULT_DEST];
+  (*result_dest) = (int)header[RESULT_DEST];
 }
 
-void send_init_subsets(double complex data[], int parts[], int nodes) {
-  // TODO Look into MPI_Scatterv, it looks like it can do this automatically
-  int data_start = 0;
-  for (int node = 1; node <= nodes; node++) {
-    if (parts[node - 1] == 0) continue;  // Skip sending to empty nodes.
-    log_msg(LOG__INFO, "Sending subset of size %i to node %i.", parts[node - 1],
-            node);
-    MPI_Send(&data[data_start], parts[node - 1], MPI_DOUBLE_COMPLEX, node,
-             SEND_SUBSET_TAG, MPI_COMM_WORLD);
+void gather_hosts(int hosts[], int nodes) {
+  // Every host is named after the lowest ranked node running on it
+  MPI_Comm host_comm;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                      &host_comm);
+  int node_id = get_node_id(), host;
+  MPI_Allreduce(&node_id, &host, 1, MPI_INT, MPI_MIN, host_comm);
+  MPI_Comm_free(&host_comm);
 
-    data_start += parts[node - 1];
-  }
+  int all_hosts[nodes + 1];
+  MPI_Gather(&host, 1, MPI_INT, all_hosts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (node_id != 0) return;
+  for (int node = 1; node <= nodes; node++) hosts[node - 1] = all_hosts[node];
+  log_msg(LOG_DEBUG, "Gathered the hosts of %i node(s).", nodes);
 }
 
-int recv_init_subset(double complex *data, int max) {
-  MPI_Status status;
-  MPI_Recv(data, max, MPI_DOUBLE_COMPLEX, 0, SEND_SUBSET_TAG, MPI_COMM_WORLD,
-           &status);
-  int received = 0;
-  MPI_Get_count(&status, MPI_DOUBLE_COMPLEX, &received);
-  log_msg(LOG__INFO, "Initial subset of size %i received.", received);
+int head_host_nodes(int *local_id) {
+  MPI_Comm host_comm;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                      &host_comm);
+  int node_id = get_node_id(), host, count;
+  MPI_Allreduce(&node_id, &host, 1, MPI_INT, MPI_MIN, host_comm);
+  MPI_Comm_rank(host_comm, local_id);
+  MPI_Comm_size(host_comm, &count);
+  MPI_Comm_free(&host_comm);
+
+  if (host != 0) *local_id = -1;
+  MPI_Bcast(&count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  return count;
+}
+
+void broadcast_tree(int64_t offsets[], int64_t result_size[],
+                    int result_dest[], int nodes) {
+  log_msg(LOG_DEBUG, "Broadcasting communication tree.");
+  MPI_Bcast(offsets, nodes, MPI_INT64_T, 0, MPI_COMM_WORLD);
+  MPI_Bcast(result_size, nodes, MPI_INT64_T, 0, MPI_COMM_WORLD);
+  MPI_Bcast(result_dest, nodes, MPI_INT, 0, MPI_COMM_WORLD);
+}
+
+int64_t broadcast_count(int64_t count) {
+  MPI_Bcast(&count, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
+  log_msg(LOG_DEBUG, "Broadcast count of %" PRId64 ".", count);
+  return count;
+}
+
+void send_init_subset(double complex data[], int64_t size, int node) {
+  log_msg(LOG__INFO, "Sending subset of size %" PRId64 " to node %i.", size,
+          node);
+  send_large(data, size, MPI_DOUBLE_COMPLEX, node, SEND_SUBSET_TAG);
+}
+
+int64_t recv_init_subset(double complex *data, int64_t max) {
+  int64_t received =
+      recv_large(data, max, MPI_DOUBLE_COMPLEX, 0, SEND_SUBSET_TAG);
+  log_msg(LOG__INFO, "Initial subset of size %" PRId64 " received.", received);
   return received;
 }
 
-void send_results(double complex *data, int size, int dest) {
-  log_msg(LOG__INFO, "Sending result of size %i to node %i.", size, dest);
-  MPI_Send(data, size, MPI_DOUBLE_COMPLEX, dest, SEND_RESULT_TAG,
-           MPI_COMM_WORLD);
+void send_results(double complex *data, int64_t size, int dest) {
+  log_msg(LOG__INFO, "Sending result of size %" PRId64 " to node %i.", size,
+          dest);
+  send_large(data, size, MPI_DOUBLE_COMPLEX, dest, SEND_RESULT_TAG);
 }
 
-int recv_result_set(double complex *data, int max) {
-  MPI_Status status;
-  MPI_Recv(data, max, MPI_DOUBLE_COMPLEX, MPI_ANY_SOURCE, SEND_RESULT_TAG,
-           MPI_COMM_WORLD, &status);
-  int received = 0;
-  MPI_Get_count(&status, MPI_DOUBLE_COMPLEX, &received);
-  log_msg(LOG__INFO, "Received result of size %i.", received);
+int64_t recv_result_set(double complex *data, int64_t max) {
+  int64_t received = recv_large(data, max, MPI_DOUBLE_COMPLEX, MPI_ANY_SOURCE,
+                                SEND_RESULT_TAG);
+  log_msg(LOG__INFO, "Received result of size %" PRId64 ".", received);
+  return received;
+}
+
+void send_reduced(double *data, int64_t size, int dest) {
+  log_msg(LOG__INFO, "Sending reduced result of size %" PRId64 " to node %i.",
+          size, dest);
+  send_large(data, size, MPI_DOUBLE, dest, SEND_REDUCED_TAG);
+}
+
+int64_t recv_reduced(double *data, int64_t max) {
+  int64_t received =
+      recv_large(data, max, MPI_DOUBLE, MPI_ANY_SOURCE, SEND_REDUCED_TAG);
+  log_msg(LOG__INFO, "Received reduced result of size %" PRId64 ".", received);
+  return received;
+}
+
+void send_dif_block(double complex *data, int64_t size, int dest) {
+  log_msg(LOG__INFO, "Sending DIF block of size %" PRId64 " to node %i.", size,
+          dest);
+  send_large(data, size, MPI_DOUBLE_COMPLEX, dest, SEND_DIF_TAG);
+}
+
+int64_t recv_dif_block(double complex *data, int64_t max, int source) {
+  int64_t received =
+      recv_large(data, max, MPI_DOUBLE_COMPLEX, source, SEND_DIF_TAG);
+  log_msg(LOG__INFO, "Received DIF block of size %" PRId64 " from node %i.",
+          received, source);
   return received;
 }
 
+int result_chunk_count(int64_t size) {
+  int64_t chunks = size / RESULT_CHUNK_MIN;
+  if (chunks < 1) return 1;
+  if (chunks > RESULT_CHUNK_MAX) return RESULT_CHUNK_MAX;
+  return (int)chunks;
+}
+
+struct msg_requests_s {
+  MPI_Request *requests;
+  int count;
+};
+
+msg_requests msg_requests_init(int count) {
+  msg_requests reqs = malloc(sizeof(struct msg_requests_s));
+  reqs->requests = malloc(sizeof(MPI_Request) * (count > 0 ? count : 1));
+  for (int i = 0; i < count; i++) reqs->requests[i] = MPI_REQUEST_NULL;
+  reqs->count = count;
+  return reqs;
+}
+
+void send_chunk_async(msg_requests reqs, int index, double complex *data,
+                      int64_t size, int dest, int chunk) {
+  log_msg(LOG_DEBUG, "Sending chunk %i of size %" PRId64 " to node %i.", chunk,
+          size, dest);
+  int count;
+  MPI_Datatype large = large_type(size, MPI_DOUBLE_COMPLEX, &count);
+  MPI_Isend(data, count, large, dest, SEND_CHUNK_TAG + chunk, MPI_COMM_WORLD,
+            &reqs->requests[index]);
+  free_large_type(large, MPI_DOUBLE_COMPLEX);
+}
+
+void recv_chunk_async(msg_requests reqs, int index, double complex *data,
+                      int64_t size, int source, int chunk) {
+  log_msg(LOG_DEBUG,
+          "Posting receive for chunk %i of size %" PRId64 " from node %i.",
+          chunk, size, source);
+  int count;
+  MPI_Datatype large = large_type(size, MPI_DOUBLE_COMPLEX, &count);
+  MPI_Irecv(data, count, large, source, SEND_CHUNK_TAG + chunk,
+            MPI_COMM_WORLD, &reqs->requests[index]);
+  free_large_type(large, MPI_DOUBLE_COMPLEX);
+}
+
+int wait_any_request(msg_requests reqs) {
+  int index;
+  MPI_Waitany(reqs->count, reqs->requests, &index, MPI_STATUS_IGNORE);
+  return index == MPI_UNDEFINED ? -1 : index;
+}
+
+void wait_all_requests(msg_requests reqs) {
+  MPI_Waitall(reqs->count, reqs->requests, MPI_STATUSES_IGNORE);
+}
+
+void msg_requests_free(msg_requests *reqs) {
+  free((*reqs)->requests);
+  free(*reqs);
+  *reqs = NULL;
+}
+
+struct shared_region_s {
+  MPI_Comm comm;
+  MPI_Win win;
+  bool allocated;
+  int *members;
+  int count;
+};
+
+shared_region shared_region_init(bool join) {
+  MPI_Comm comm;
+  MPI_Comm_split_type(MPI_COMM_WORLD,
+                      join ? MPI_COMM_TYPE_SHARED : MPI_UNDEFINED, 0,
+                      MPI_INFO_NULL, &comm);
+  if (comm == MPI_COMM_NULL) return NULL;
+
+  shared_region shm = malloc(sizeof(struct shared_region_s));
+  shm->comm = comm;
+  shm->allocated = false;
+  MPI_Comm_size(comm, &shm->count);
+  shm->members = malloc(sizeof(int) * shm->count);
+  int node_id = get_node_id();
+  MPI_Allgather(&node_id, 1, MPI_INT, shm->members, 1, MPI_INT, comm);
+  log_msg(LOG__INFO, "Sharing memory with %i node(s) on this host.",
+          shm->count - 1);
+  return shm;
+}
+
+bool shared_region_local(shared_region shm, int node) {
+  if (shm == NULL) return false;
+  for (int i = 0; i < shm->count; i++)
+    if (shm->members[i] == node) return true;
+  return false;
+}
+
+double complex *shared_region_alloc(shared_region shm, int64_t size) {
+  // Every node allocates its own segment so none of them ends up holding the
+  // whole buffer, by default the segments follow each other in rank order
+  MPI_Aint bytes = sizeof(double complex) * (MPI_Aint)size;
+  double complex *segment;
+  MPI_Win_allocate_shared(bytes, sizeof(double complex), MPI_INFO_NULL,
+                          shm->comm, &segment, &shm->win);
+  int disp_unit;
+  double complex *base;
+  MPI_Win_shared_query(shm->win, 0, &bytes, &disp_unit, &base);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, shm->win);
+  shm->allocated = true;
+  log_msg(LOG_DEBUG,
+          "Mapped shared segment of size %" PRId64 " at offset %" PRId64 ".",
+          size, (int64_t)(segment - base));
+  return base;
+}
+
+void shared_region_sync(shared_region shm) { MPI_Win_sync(shm->win); }
+
+void shared_region_free(shared_region *shm) {
+  if (*shm == NULL) return;
+  if ((*shm)->allocated) {
+    MPI_Win_unlock_all((*shm)->win);
+    MPI_Win_free(&(*shm)->win);
+  }
+  MPI_Comm_free(&(*shm)->comm);
+  free((*shm)->members);
+  free(*shm);
+  *shm = NULL;
+}
+
+void msg_barrier() { MPI_Barrier(MPI_COMM_WORLD); }
+
 void msg_finalize() {
   MPI_Barrier(MPI_COMM_WORLD);
   MPI_Finalize();
@@ -3,96 +3,904 @@
 
 #include "node.h"
 
+#include <assert.h>
 #include <complex.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "bitmanip.h"
 #include "fft.h"
 #include "logging.h"
 #include "messaging.h"
+#include "ooc.h"
+#include "tree.h"
 
-void head_node(const char* filename, bool header, bool inverse) {
+// The most results a node can receive, one for each doubling of its subset
+#define MAX_CHILDREN 63
+
+// Butterflies are timed with the fastest of CALIBRATION_REPEATS transforms of
+// up to CALIBRATION_SIZE values, after one to warm up.
+#define CALIBRATION_SIZE (1 << 12)
+#define CALIBRATION_REPEATS 8
+
+// Where a data node sits in the communication tree. children[i] is the node
+// that sends it a result of size subset_size * 2^i, which goes at
+// child_start[i] in this node's result, and its own subset goes at
+// subset_start.
+struct tree_place {
+  int64_t subset_size;
+  int64_t subset_start;
+  int64_t result_size;
+  int result_dest;
+  int levels;
+  int children[MAX_CHILDREN];
+  int64_t child_start[MAX_CHILDREN];
+};
+
+// Reserves the memory for all of a node's buffers at once.
+static arena reserve_arena(size_t bytes, enum arena_pages pages) {
+  log_msg(LOG_DEBUG, "Reserving %zu bytes of node memory.", bytes);
+  arena mem = arena_init(bytes, pages);
+  if (mem == NULL) {
+    log_msg(LOG_FATAL, "Unable to reserve %zu bytes of node memory.", bytes);
+    msg_abort();
+  }
+  if (arena_page_kind(mem) != pages)
+    log_msg(LOG__WARN, "Unable to reserve huge pages, using transparent ones.");
+  return mem;
+}
+
+// Every result covers the aligned block of its own size that contains the
+// subset of the node sending it.
+static int64_t result_start(int64_t offset, int64_t size) {
+  return offset - offset % size;
+}
+
+// Fills in the rest of this node's place in the communication tree, the sizes
+// and destination from its header must already be set. Nodes with a subset
+// size of 0 never had their destination set.
+static void find_place(struct tree_place* place, int64_t all_offset[],
+                       int64_t all_size[], int all_dest[], int nodes) {
+  int node_id = get_node_id();
+  int64_t start = result_start(all_offset[node_id - 1], place->result_size);
+  place->subset_start = all_offset[node_id - 1] - start;
+  place->levels = 0;
+  while ((place->subset_size << place->levels) < place->result_size)
+    place->levels++;
+  for (int j = 0; j < nodes; j++) {
+    if (all_size[j] == 0 || all_size[j] >= place->result_size) continue;
+    if (all_dest[j] != node_id) continue;
+    int child = 0;
+    while ((place->subset_size << child) < all_size[j]) child++;
+    place->children[child] = j + 1;
+    place->child_start[child] =
+        result_start(all_offset[j], all_size[j]) - start;
+  }
+}
+
+// In shared memory mode each chain of nodes on the same host works in one
+// segment of the host's shared buffer, placed so a child's result already sits
+// where its parent would have received it. Every node whose result leaves the
+// host starts a segment of its own, so the results of nodes further down never
+// overlap a buffer that is still waiting on a message. Returns the offset of
+// this node's result in the buffer.
+static int64_t shared_offset(shared_region shm, int64_t all_offset[],
+                             int64_t all_size[], int all_dest[], int nodes) {
+  int node_id = get_node_id();
+  int top = node_id;
+  while (shared_region_local(shm, all_dest[top - 1])) top = all_dest[top - 1];
+
+  int64_t segment = 0, total = 0;
+  for (int node = 1; node <= nodes; node++) {
+    int64_t size = all_size[node - 1];
+    if (size == 0 || !shared_region_local(shm, node) ||
+        shared_region_local(shm, all_dest[node - 1]))
+      continue;
+    if (node == top) segment = total;
+    total += size;
+  }
+  return segment +
+         result_start(all_offset[node_id - 1], all_size[node_id - 1]) -
+         result_start(all_offset[top - 1], all_size[top - 1]);
+}
+
+// The part of the shared buffer this node writes first, its own subset and the
+// results it receives from nodes on other hosts. The shares of every node on
+// the host add up to the whole buffer, so each one allocates its own segment
+// and the pages it touches first stay on its side of the machine.
+static int64_t shared_share(struct tree_place* place, shared_region shm) {
+  int64_t share = place->subset_size;
+  for (int child = 0; child < place->levels; child++)
+    if (!shared_region_local(shm, place->children[child]))
+      share += place->subset_size << child;
+  return share;
+}
+
+// Pruned results are only valid once the whole butterfly is done, so they are
+// always sent in one piece. Results from a node sharing memory with the
+// receiver are already in place, only an empty message saying so is sent.
+static int chunk_count(int64_t size, int bincount, bool local) {
+  return bincount > 0 || local ? 1 : result_chunk_count(size);
+}
+
+// Posts a receive for every chunk of every child's result straight into the
+// place it belongs in data.
+static msg_requests post_child_receives(double complex data[],
+                                        struct tree_place* place, int bincount,
+                                        shared_region shm) {
+  int total = 0;
+  for (int child = 0; child < place->levels; child++)
+    total += chunk_count(place->subset_size << child, bincount,
+                         shared_region_local(shm, place->children[child]));
+  msg_requests reqs = msg_requests_init(total);
+
+  int index = 0;
+  for (int child = 0; child < place->levels; child++) {
+    bool local = shared_region_local(shm, place->children[child]);
+    int chunks = chunk_count(place->subset_size << child, bincount, local);
+    int64_t chunk_size = local ? 0 : (place->subset_size << child) / chunks;
+    double complex* result = &data[place->child_start[child]];
+    for (int k = 0; k < chunks; k++)
+      recv_chunk_async(reqs, index++, &result[k * chunk_size], chunk_size,
+                       place->children[child], k);
+  }
+  return reqs;
+}
+
+// Keeps track of which chunks of this node's own result are finished, and
+// starts sending each one as soon as it is. If the destination shares memory
+// with this node shm is set and it is only told when the result is finished.
+struct result_sender {
+  msg_requests sends;
+  shared_region shm;
+  int chunks;
+  int64_t chunk_size;
+  int dest;
+  int64_t finalized[RESULT_CHUNK_MAX];
+};
+
+// A range merged in one piece, after a child in shared memory, can cover
+// several of the chunks the result is sent in.
+static void finalize_range(struct result_sender* sender, double complex data[],
+                           int64_t first, int64_t count) {
+  int64_t end = first + count;
+  while (first < end) {
+    int chunk = (int)(first / sender->chunk_size);
+    int64_t chunk_end = (chunk + 1) * sender->chunk_size;
+    int64_t part = (end < chunk_end ? end : chunk_end) - first;
+    sender->finalized[chunk] += part;
+    first += part;
+    if (sender->finalized[chunk] < sender->chunk_size) continue;
+    if (sender->shm != NULL) shared_region_sync(sender->shm);
+    send_chunk_async(sender->sends, chunk, &data[chunk * sender->chunk_size],
+                     sender->shm != NULL ? 0 : sender->chunk_size,
+                     sender->dest, chunk);
+  }
+}
+
+// Merges the results of this node's children into data as their chunks arrive,
+// the subset this node computed itself must already be in place. Each chunk of
+// a child's result can be butterflied with the matching part of this node's
+// data as soon as it arrives, as long as everything smaller has already been
+// merged. If result_dest is another data node the result is sent in chunks as
+// the final butterfly finishes them, otherwise it is left in data. If any bins
+// are given the merges are pruned to them. Results from children in shm are
+// read straight out of data once they say they are finished.
+static void merge_results(double complex data[], msg_requests reqs,
+                          struct tree_place* place, bool inverse,
+                          int64_t bins[], int bincount, int64_t needed[],
+                          shared_region shm) {
+  int levels = place->levels;
+  int64_t result_size = place->result_size;
+  int result_dest = place->result_dest;
+  int level_start[levels + 1];
+  level_start[0] = 0;
+  for (int level = 0; level < levels; level++)
+    level_start[level + 1] =
+        level_start[level] +
+        chunk_count(place->subset_size << level, bincount,
+                    shared_region_local(shm, place->children[level]));
+  bool arrived[level_start[levels] + 1];
+  memset(arrived, 0, sizeof(arrived));
+
+  struct result_sender sender = {.dest = result_dest};
+  if (result_dest != 0) {
+    bool local = shared_region_local(shm, result_dest);
+    sender.shm = local ? shm : NULL;
+    sender.chunks = chunk_count(result_size, bincount, local);
+    sender.chunk_size = result_size / sender.chunks;
+    sender.sends = msg_requests_init(sender.chunks);
+    memset(sender.finalized, 0, sizeof(sender.finalized));
+  }
+
+  int64_t data_start = place->subset_start;
+  int64_t data_size = place->subset_size;
+  for (int level = 0; level < levels; level++) {
+    int chunks = level_start[level + 1] - level_start[level];
+    int64_t chunk_size = data_size / chunks;
+    if (place->child_start[level] < data_start)
+      data_start = place->child_start[level];
+    bool last = 2 * data_size == result_size;
+    bool done[chunks];
+    memset(done, 0, sizeof(done));
+    int butterflies = bincount > 0 ? fft_pruned_butterflies(
+                                         2 * data_size, bins, bincount, needed)
+                                   : 0;
+
+    log_msg(LOG_DEBUG, "Starting FFT pass of size %" PRId64 ".",
+            2 * data_size);
+    int remaining = chunks;
+    while (remaining > 0) {
+      for (int k = 0; k < chunks; k++) {
+        if (done[k] || !arrived[level_start[level] + k]) continue;
+        int64_t first = k * chunk_size;
+        if (bincount > 0)
+          fft_butterfly_pruned(&data[data_start], 2 * data_size, inverse,
+                               needed, butterflies);
+        else
+          fft_butterfly_range(&data[data_start], 2 * data_size, inverse, first,
+                              first + chunk_size);
+        if (last && result_dest != 0) {
+          finalize_range(&sender, data, first, chunk_size);
+          finalize_range(&sender, data, first + data_size, chunk_size);
+        }
+        done[k] = true;
+        remaining--;
+      }
+      if (remaining == 0) break;
+      int index = wait_any_request(reqs);
+      if (index < 0) {  // Nothing left to arrive, the tree is inconsistent
+        log_msg(LOG_FATAL, "No results left to wait for, %i chunk(s) missing.",
+                remaining);
+        msg_abort();
+      }
+      arrived[index] = true;
+      if (shm != NULL) shared_region_sync(shm);
+    }
+    log_msg(LOG_DEBUG, "FFT pass finished.");
+    data_size *= 2;
+  }
+  msg_requests_free(&reqs);
+
+  if (result_dest != 0) {
+    if (levels == 0)  // Nothing was merged, the whole result is ready
+      for (int k = 0; k < sender.chunks; k++)
+        finalize_range(&sender, data, k * sender.chunk_size,
+                       sender.chunk_size);
+    wait_all_requests(sender.sends);
+    if (sender.shm != NULL) {
+      log_msg(LOG__INFO,
+              "Left result of size %" PRId64 " in shared memory for node %i.",
+              result_size, result_dest);
+    } else {
+      log_msg(LOG__INFO,
+              "Sent result of size %" PRId64 " to node %i in %i chunk(s).",
+              result_size, result_dest, sender.chunks);
+    }
+    msg_requests_free(&sender.sends);
+  }
+}
+
+// Which host each node runs on is only needed to build or print the tree.
+static bool needs_hosts(struct tree_options tree) {
+  return tree.topology || tree.dry_run;
+}
+
+// Times a small transform to find how long a single butterfly takes.
+static double time_butterflies(int64_t N) {
+  int n = N < CALIBRATION_SIZE ? (int)N : CALIBRATION_SIZE;
+  double complex* X = calloc(n, sizeof(double complex));
+  fft(X, n, false);
+  double fastest = 0;
+  for (int i = 0; i < CALIBRATION_REPEATS; i++) {
+    double start = get_time();
+    fft(X, n, false);
+    double elapsed = get_time() - start;
+    if (i == 0 || elapsed < fastest) fastest = elapsed;
+  }
+  free(X);
+  int levels = 0;
+  while ((1 << levels) < n) levels++;
+  return fastest / (n / 2 * levels);
+}
+
+// Measures the system and picks how many nodes should take part in a
+// transform of size N, node 1 has to answer the link measurement. If serial
+// is true the head node may be picked to do the whole transform.
+static int auto_size(int64_t N, int nodes, bool serial) {
+  struct cost_model model;
+  measure_link(1, &model.latency, &model.element_time);
+  model.butterfly_time = time_butterflies(N);
+  log_msg(LOG_DEBUG, "Measured %g s per butterfly.", model.butterfly_time);
+
+  int active = pick_node_count(N, nodes, model, serial);
+  double time = model_time(N, active, model);
+  double all = model_time(N, nodes, model);
+  if (active == 0) {
+    log_msg(LOG__INFO,
+            "Transforming locally, modeled %g s against %g s with %i node(s).",
+            time, all, nodes);
+  } else {
+    log_msg(LOG__INFO,
+            "Using %i of %i node(s), modeled %g s against %g s with all.",
+            active, nodes, time, all);
+  }
+  return active;
+}
+
+// The data node side of build_tree(), must be called before the header is
+// received.
+static void follow_tree(struct tree_options tree, int nodes) {
+  if (needs_hosts(tree) && tree.hostfile == NULL) gather_hosts(NULL, nodes);
+  if (tree.auto_size && get_node_id() == 1) echo_link(0);
+}
+
+// Builds the communication tree for a transform of size N, either the one from
+// result_targets() or one that keeps merges on the same host. For a dry run
+// the tree is printed instead of used. Returns the number of nodes taking
+// part, which is only less than nodes when it is picked automatically. If
+// serial is true that may be 0, every node is then left without a subset and
+// the head node should do the whole transform.
+static int build_tree(int64_t N, int64_t parts[], int64_t offsets[],
+                      int64_t result_size[], int result_dest[], int nodes,
+                      struct tree_options tree, bool serial) {
+  int hosts[nodes];
+  if (needs_hosts(tree)) {
+    if (tree.hostfile == NULL) {
+      gather_hosts(hosts, nodes);
+    } else if (read_host_hints(tree.hostfile, hosts, nodes) != 0) {
+      log_msg(LOG_FATAL, "Unable to place every node with host hints: %s",
+              tree.hostfile);
+      msg_abort();
+    }
+  }
+
+  int active = tree.auto_size ? auto_size(N, nodes, serial) : nodes;
+
+  // The messaging functions contain their own logs but the fft functions do
+  // not, intentionally.
+  log_msg(LOG__INFO, "Building communication tree.");
+  memset(parts, 0, sizeof(int64_t) * nodes);
+  memset(offsets, 0, sizeof(int64_t) * nodes);
+  memset(result_size, 0, sizeof(int64_t) * nodes);
+  memset(result_dest, 0, sizeof(int) * nodes);
+  if (active > 0 && tree.topology) {
+    topology_targets(N, active, parts, offsets, result_size, result_dest,
+                     hosts, nodes);
+  } else if (active > 0) {
+    // Nodes left out come first, just like ones without enough work
+    partition_pow2(N, &parts[nodes - active], active);
+    result_targets(result_size, result_dest, parts, nodes);
+    subset_offsets(offsets, parts, nodes);
+  }
+
+  if (needs_hosts(tree)) {
+    struct tree_cost cost;
+    tree_cost(&cost, parts, result_size, result_dest, hosts, nodes);
+    log_msg(LOG__INFO, "Communication tree sends %i result(s) between hosts.",
+            cost.cross_transfers);
+  }
+  if (tree.dry_run)
+    print_tree(parts, offsets, result_size, result_dest, hosts, nodes);
+  return active;
+}
+
+// Counts the requested bins below N, the sorted bins past them are dropped.
+static int bins_below(int64_t bins[], int bincount, int64_t N) {
+  int count = 0;
+  while (count < bincount && bins[count] < N) count++;
+  return count;
+}
+
+// Packs the requested bins of a finished spectrum to the front in place, the
+// bins are sorted so none are overwritten before they are read. Returns the
+// number of bins that fit in the spectrum, N if no bins were requested.
+static int64_t pack_bins(double complex data[], int64_t N, int64_t bins[],
+                         int bincount) {
+  if (bincount == 0) return N;
+  int64_t size = 0;
+  while (size < bincount && bins[size] < N) {
+    data[size] = data[bins[size]];
+    size++;
+  }
+  return size;
+}
+
+// Reduces a finished spectrum after pack_bins(), returns the number of doubles
+// in out.
+static int64_t reduce_bins(double complex data[], int64_t size,
+                           struct reduction reduce, int64_t bins[],
+                           int bincount, double out[]) {
+  int64_t reduced = reduced_size(reduce, size);
+  log_msg(LOG_DEBUG, "Starting reduction.");
+  reduce_spectrum(data, size, reduce, out);
+  log_msg(LOG_DEBUG, "Finished reduction.");
+  // Peaks are found by their position among the packed bins
+  if (bincount > 0 && reduce.type == REDUCE_PEAKS)
+    for (int64_t j = 0; j < reduced; j += 3) out[j] = bins[(int64_t)out[j]];
+  return reduced;
+}
+
+// Runs the whole transform on the head node, for when it is too small to be
+// worth sending anywhere. The input must already be in bit reversal
+// permutation order. Working buffers come from mem, sized by head_buffers().
+static void serial_transform(double complex data[], int64_t N, bool inverse,
+                             struct reduction reduce, int64_t bins[],
+                             int bincount, arena mem) {
+  log_msg(LOG_DEBUG, "Starting FFT calculation.");
+  if (bincount > 0) {
+    int64_t* needed =
+        arena_alloc(mem, sizeof(int64_t) * fft_pruned_size(N, bincount));
+    fft_pruned(data, N, inverse, bins, bincount, needed);
+  } else {
+    fft(data, N, inverse);
+  }
+  log_msg(LOG_DEBUG, "Finished FFT calculation.");
+
+  int64_t size = pack_bins(data, N, bins, bincount);
+  // 1/N factor for inverse FFT
+  if (inverse)
+    for (int64_t j = 0; j < size; j++) data[j] /= N;
+
+  if (reduce.type != REDUCE_NONE) {
+    double* out = arena_alloc(mem, sizeof(double) * reduced_size(reduce, size));
+    int64_t reduced = reduce_bins(data, size, reduce, bins, bincount, out);
+    print_reduced(out, reduced, reduce);
+  } else {
+    print_complex(data, size);
+  }
+}
+
+static int64_t largest_part(int64_t parts[], int nodes) {
+  int64_t largest = 0;
+  for (int i = 0; i < nodes; i++)
+    if (parts[i] > largest) largest = parts[i];
+  return largest;
+}
+
+// Sends every node its subset of the bit reversal permutation of data. Each
+// subset is an aligned slice of the permutation, which is every N / part-th
+// value of data starting at the bit reversal of the slice's index, so it is
+// permuted straight into a send buffer and data itself is left untouched.
+static void send_subsets(double complex data[], int64_t N, int64_t parts[],
+                         int64_t offsets[], int nodes, arena mem) {
+  double complex* buffer =
+      arena_alloc(mem, sizeof(double complex) * largest_part(parts, nodes));
+
+  log_msg(LOG__INFO, "Applying bit reversal permutation to input dataset.");
+  for (int node = 1; node <= nodes; node++) {
+    int64_t part = parts[node - 1];
+    if (part == 0) continue;  // Skip sending to empty nodes.
+    assert(offsets[node - 1] % part == 0);
+    int slices = bit_length(N / part) - 1;
+    int64_t start =
+        slices > 0 ? bit_reverse(offsets[node - 1] / part, slices) : 0;
+    bit_reversal_copy(buffer, &data[start], part, N / part);
+    send_init_subset(buffer, part, node);
+  }
+}
+
+// Reserves every buffer the head node needs besides its input, which is only
+// sized once it has been read: the pruned butterflies when it transforms by
+// itself or a send buffer for the largest subset otherwise, and the reduced
+// spectrum.
+static arena head_buffers(int64_t N, int64_t output_size, int active,
+                          int64_t parts[], int nodes, struct reduction reduce,
+                          int bincount, enum arena_pages pages) {
+  size_t work_bytes = active > 0
+                          ? sizeof(double complex) * largest_part(parts, nodes)
+                          : sizeof(int64_t) * fft_pruned_size(N, bincount);
+  size_t out_bytes = reduce.type != REDUCE_NONE
+                         ? sizeof(double) * reduced_size(reduce, output_size)
+                         : 0;
+  return reserve_arena(arena_size(work_bytes) + arena_size(out_bytes), pages);
+}
+
+void head_node(const char* filename, bool header, bool inverse,
+               struct reduction reduce, int64_t bins[], int bincount,
+               enum arena_pages pages, bool shared, struct tree_options tree) {
   int nodes = get_node_count();
   nodes--;  // Not counting node 0, us!
 
   log_msg(LOG__INFO, "Reading input dataset.");
-  int input_size = 0;
+  int64_t input_size = 0;
   double complex* data = csv2cmplx(filename, header, &input_size);
   if (data == NULL) {
     log_msg(LOG_FATAL, "Unable to read input file: %s", filename);
     msg_abort();
   }
 
-  // The messaging functions contain their own logs but the fft functions do
-  // not, intentionally.
-  log_msg(LOG__INFO, "Calculating node partitions.");
-  int parts[nodes];
-  partition_pow2(input_size, parts, nodes);
+  // Only the requested bins that fit in the transform are sent back
+  int64_t output_size = input_size;
+  if (bincount > 0) {
+    bincount = bins_below(bins, bincount, input_size);
+    output_size = bincount;
+    if (output_size == 0) {
+      log_msg(LOG_FATAL,
+              "No requested bins are below the transform size %" PRId64 ".",
+              input_size);
+      msg_abort();
+    }
+    log_msg(LOG__INFO, "Pruning transform to %" PRId64 " bin(s).",
+            output_size);
+  }
 
-  log_msg(LOG__INFO, "Building communication tree.");
-  int result_size[nodes];
+  int64_t parts[nodes];
+  int64_t offsets[nodes];
+  int64_t result_size[nodes];
   int result_dest[nodes];
-  result_targets(result_size, result_dest, parts, nodes);
-
-  log_msg(LOG__INFO, "Applying bit reversal permutation to input dataset.");
-  bit_reversal_permutation(data, input_size);
+  int active = build_tree(input_size, parts, offsets, result_size,
+                          result_dest, nodes, tree, true);
+  if (tree.dry_run) {
+    free(data);
+    return;
+  }
 
   send_headers(parts, result_size, result_dest, nodes);
+  broadcast_tree(offsets, result_size, result_dest, nodes);
+  // Only data nodes share memory, but finding them involves every node
+  if (shared) shared_region_init(false);
 
-  send_init_subsets(data, parts, nodes);
+  arena mem = head_buffers(input_size, output_size, active, parts, nodes,
+                           reduce, bincount, pages);
+  if (active == 0) {
+    log_msg(LOG__INFO, "Applying bit reversal permutation to input dataset.");
+    bit_reversal_permutation(data, input_size);
+    serial_transform(data, input_size, inverse, reduce, bins, bincount, mem);
+    arena_free(&mem);
+    free(data);
+    return;
+  }
+
+  send_subsets(data, input_size, parts, offsets, nodes, mem);
+
+  if (reduce.type != REDUCE_NONE) {
+    // The spectrum itself never comes back, only the reduced form of it
+    free(data);
+    int64_t size = reduced_size(reduce, output_size);
+    double* out = arena_alloc(mem, sizeof(double) * size);
+    size = recv_reduced(out, size);
+    print_reduced(out, size, reduce);
+    arena_free(&mem);
+    return;
+  }
+  arena_free(&mem);
 
-  recv_result_set(data, input_size);
+  recv_result_set(data, output_size);
 
   //1/N factor for inverse FFT
-  if(inverse) for(int j = 0; j < input_size; j++) data[j] /= input_size;
+  if(inverse) for(int64_t j = 0; j < output_size; j++) data[j] /= input_size;
 
-  print_complex(data, input_size);
+  print_complex(data, output_size);
 
   free(data);
 }
 
-void data_node(bool inverse) {
-  int subset_size, result_size, result_dest;
+void data_node(bool inverse, struct reduction reduce, int64_t bins[],
+               int bincount, enum arena_pages pages, bool shared,
+               struct tree_options tree) {
+  int nodes = get_node_count() - 1;
+  follow_tree(tree, nodes);
+  if (tree.dry_run) return;
+
+  struct tree_place place;
+  recv_header(&place.subset_size, &place.result_size, &place.result_dest);
+  int64_t subset_size = place.subset_size, result_size = place.result_size;
+  int result_dest = place.result_dest;
 
-  recv_header(&subset_size, &result_size, &result_dest);
+  int64_t all_offset[nodes];
+  int64_t all_size[nodes];
+  int all_dest[nodes];
+  broadcast_tree(all_offset, all_size, all_dest, nodes);
+  shared_region shm = shared ? shared_region_init(subset_size > 0) : NULL;
 
   if (subset_size == 0) {
     log_msg(LOG__WARN, "Received subset size of 0, terminating.");
     return;
   }
 
-  double complex data[result_size];
-  int data_start = result_size - subset_size;
-  int data_size = subset_size;
+  find_place(&place, all_offset, all_size, all_dest, nodes);
+
+  // The last node's result is the whole transform, bins past it are dropped
+  int64_t N = 0;
+  for (int i = 0; i < nodes; i++)
+    if (all_size[i] > N) N = all_size[i];
+  bincount = bins_below(bins, bincount, N);
+
+  // In shared memory mode the result lives in the host's shared buffer instead
+  bool reducing = result_dest == 0 && reduce.type != REDUCE_NONE;
+  size_t data_bytes = sizeof(double complex) * result_size;
+  size_t out_bytes = sizeof(double) * reduced_size(reduce, result_size);
+  size_t needed_bytes =
+      sizeof(int64_t) * fft_pruned_size(result_size, bincount);
+  size_t mem_bytes = (shm == NULL ? arena_size(data_bytes) : 0) +
+                     (reducing ? arena_size(out_bytes) : 0) +
+                     (bincount > 0 ? arena_size(needed_bytes) : 0);
+  arena mem = mem_bytes > 0 ? reserve_arena(mem_bytes, pages) : NULL;
+  double complex* data;
+  if (shm != NULL) {
+    int64_t offset = shared_offset(shm, all_offset, all_size, all_dest, nodes);
+    data = &shared_region_alloc(shm, shared_share(&place, shm))[offset];
+  } else {
+    data = arena_alloc(mem, data_bytes);
+  }
+  int64_t* needed = bincount > 0 ? arena_alloc(mem, needed_bytes) : NULL;
+
+  // Results from children can stream in while this node does its own part
+  msg_requests reqs = post_child_receives(data, &place, bincount, shm);
+
+  int64_t data_start = place.subset_start;
   recv_init_subset(&data[data_start], subset_size);
 
   // perform
   log_msg(LOG_DEBUG, "Starting inital FFT calculation.");
-  fft(&data[data_start], subset_size, inverse);
+  if (bincount > 0)
+    fft_pruned(&data[data_start], subset_size, inverse, bins, bincount,
+               needed);
+  else
+    fft(&data[data_start], subset_size, inverse);
   log_msg(LOG_DEBUG, "Finished inital FFT calculation.");
 
-  // TODO More clever use of flow control could reduce redundant operations
-  log_msg(LOG_DEBUG, "Allocating FFT buffer.");
-  fft_buffer buf = fft_buffer_init();
-  while (data_size < result_size) {
-    // The upper bounds on size should actually be this / 2, the extra space
-    // is just-in-case
-    double complex temp[result_size];
-    int size_received = recv_result_set(temp, result_size);
-
-    log_msg(LOG_DEBUG, "Adding entry to FFT buffer.");
-    fft_buffer_add(buf, temp, size_received);
-    double complex* match;
-    while ((match = fft_buffer_search(buf, data_size)) != NULL) {
-      data_start -= data_size;
-      memcpy(&data[data_start], match, sizeof(double complex) * data_size);
-      data_size *= 2;
-      log_msg(LOG_DEBUG, "Starting FFT pass of size %i.", data_size);
-      fft_butterfly(&data[data_start], data_size, inverse);
-      log_msg(LOG_DEBUG, "FFT pass finished.");
+  merge_results(data, reqs, &place, inverse, bins, bincount, needed, shm);
+  if (result_dest != 0) {  // Already sent up the tree
+    if (mem != NULL) arena_free(&mem);
+    shared_region_free(&shm);
+    return;
+  }
+
+  int64_t size = pack_bins(data, result_size, bins, bincount);
+
+  // Only the last node holds the whole spectrum, reduce it where it lives
+  if (reducing) {
+    // 1/N factor for inverse FFT, normally applied by the head node
+    if (inverse)
+      for (int64_t j = 0; j < size; j++) data[j] /= result_size;
+    double* out = arena_alloc(mem, out_bytes);
+    int64_t reduced = reduce_bins(data, size, reduce, bins, bincount, out);
+    send_reduced(out, reduced, result_dest);
+  } else {
+    send_results(data, size, result_dest);
+  }
+
+  if (mem != NULL) arena_free(&mem);
+  shared_region_free(&shm);
+}
+
+// Receives this node's block from its parent and runs the decimation-in-
+// frequency pass down the communication tree, the mirror image of
+// merge_results(). After each butterfly one half belongs to the child that
+// would have sent it as a result. The subset this node keeps ends up at its
+// subset_start in bit reversal permutation order.
+static void scatter_dif(double complex data[], struct tree_place* place) {
+  recv_dif_block(data, place->result_size, place->result_dest);
+  int64_t data_start = 0;
+  int64_t data_size = place->result_size;
+  for (int child = place->levels - 1; child >= 0; child--) {
+    log_msg(LOG_DEBUG, "Starting DIF pass of size %" PRId64 ".", data_size);
+    fft_dif_butterfly(&data[data_start], data_size, false);
+    log_msg(LOG_DEBUG, "DIF pass finished.");
+    data_size /= 2;
+    send_dif_block(&data[place->child_start[child]], data_size,
+                   place->children[child]);
+    if (place->child_start[child] == data_start) data_start += data_size;
+  }
+  log_msg(LOG_DEBUG, "Starting inital DIF calculation.");
+  fft_dif(&data[data_start], place->subset_size, false);
+  log_msg(LOG_DEBUG, "Finished inital DIF calculation.");
+}
+
+void convolve_head_node(const char* filename, const char* kernelname,
+                        bool header, bool correlate, int64_t block_size,
+                        enum arena_pages pages, struct tree_options tree) {
+  int nodes = get_node_count();
+  nodes--;  // Not counting node 0, us!
+
+  log_msg(LOG__INFO, "Reading input dataset.");
+  int64_t signal_len = 0, padded = 0;
+  double complex* signal =
+      csv2cmplx_len(filename, header, &signal_len, &padded);
+  if (signal == NULL) {
+    log_msg(LOG_FATAL, "Unable to read input file: %s", filename);
+    msg_abort();
+  }
+
+  log_msg(LOG__INFO, "Reading kernel dataset.");
+  int64_t kernel_len = 0;
+  double complex* kernel =
+      csv2cmplx_len(kernelname, header, &kernel_len, &padded);
+  if (kernel == NULL) {
+    log_msg(LOG_FATAL, "Unable to read kernel file: %s", kernelname);
+    msg_abort();
+  }
+
+  // Correlation is convolution with the reversed conjugate of the kernel, the
+  // output then starts at a lag of -(kernel_len - 1).
+  if (correlate) {
+    for (int64_t j = 0; j < kernel_len / 2; j++) {
+      double complex temp = kernel[j];
+      kernel[j] = kernel[kernel_len - 1 - j];
+      kernel[kernel_len - 1 - j] = temp;
     }
+    for (int64_t j = 0; j < kernel_len; j++) kernel[j] = conj(kernel[j]);
+  }
+
+  int64_t output_len = signal_len + kernel_len - 1;
+  int64_t N = block_size;
+  if (N == 0) {  // A single transform big enough for the whole output
+    N = 2;
+    while (N < output_len) N *= 2;
+  }
+  if (N < kernel_len) {
+    log_msg(LOG_FATAL,
+            "Block size %" PRId64 " is smaller than the kernel size %" PRId64
+            ".",
+            N, kernel_len);
+    msg_abort();
   }
-  fft_buffer_free(&buf);
 
-  send_results(data, result_size, result_dest);
-}
\ No newline at end of file
+  // Overlap-save, each block of N yields step valid outputs and the first
+  // kernel_len - 1 outputs of every block are discarded.
+  int64_t step = N - (kernel_len - 1);
+  int64_t segments = (output_len + step - 1) / step;
+  log_msg(LOG__INFO, "Convolving in %" PRId64 " block(s) of size %" PRId64 ".",
+          segments, N);
+
+  int64_t parts[nodes];
+  int64_t offsets[nodes];
+  int64_t result_size[nodes];
+  int result_dest[nodes];
+  build_tree(N, parts, offsets, result_size, result_dest, nodes, tree, false);
+  if (tree.dry_run) {
+    free(kernel);
+    free(signal);
+    return;
+  }
+
+  send_headers(parts, result_size, result_dest, nodes);
+  broadcast_tree(offsets, result_size, result_dest, nodes);
+  broadcast_count(segments);
+
+  // The final node in the tree takes the whole block and splits it up
+  int root = 1;
+  while (parts[root - 1] == 0 || result_dest[root - 1] != 0) root++;
+  // Every block of the signal reuses the same buffer
+  arena mem = reserve_arena(arena_size(sizeof(double complex) * N), pages);
+  double complex* block = arena_alloc(mem, sizeof(double complex) * N);
+  memset(block, 0, sizeof(double complex) * N);
+  memcpy(block, kernel, sizeof(double complex) * kernel_len);
+  send_dif_block(block, N, root);
+  free(kernel);
+
+  for (int64_t segment = 0; segment < segments; segment++) {
+    int64_t start = segment * step - (kernel_len - 1);
+    for (int64_t j = 0; j < N; j++)
+      block[j] = (start + j >= 0 && start + j < signal_len) ? signal[start + j]
+                                                            : 0;
+    send_dif_block(block, N, root);
+    recv_result_set(block, N);
+
+    int64_t count = step;
+    if (segment * step + count > output_len)
+      count = output_len - segment * step;
+    double complex* valid = &block[kernel_len - 1];
+    // 1/N factor for inverse FFT
+    for (int64_t j = 0; j < count; j++) valid[j] /= N;
+    print_complex(valid, count);
+  }
+
+  arena_free(&mem);
+  free(signal);
+}
+
+void convolve_data_node(enum arena_pages pages, struct tree_options tree) {
+  int nodes = get_node_count() - 1;
+  follow_tree(tree, nodes);
+  if (tree.dry_run) return;
+
+  struct tree_place place;
+  recv_header(&place.subset_size, &place.result_size, &place.result_dest);
+  int64_t subset_size = place.subset_size, result_size = place.result_size;
+  int result_dest = place.result_dest;
+
+  int64_t all_offset[nodes];
+  int64_t all_size[nodes];
+  int all_dest[nodes];
+  broadcast_tree(all_offset, all_size, all_dest, nodes);
+  int64_t segments = broadcast_count(0);
+
+  if (subset_size == 0) {
+    log_msg(LOG__WARN, "Received subset size of 0, terminating.");
+    return;
+  }
+
+  find_place(&place, all_offset, all_size, all_dest, nodes);
+
+  // Every block of the signal reuses the same buffers
+  size_t data_bytes = sizeof(double complex) * result_size;
+  size_t kernel_bytes = sizeof(double complex) * subset_size;
+  arena mem = reserve_arena(arena_size(data_bytes) + arena_size(kernel_bytes),
+                            pages);
+  double complex* data = arena_alloc(mem, data_bytes);
+  double complex* kernel = arena_alloc(mem, kernel_bytes);
+  int64_t data_start = place.subset_start;
+
+  // The kernel's spectrum is kept for every block of the signal
+  scatter_dif(data, &place);
+  memcpy(kernel, &data[data_start], sizeof(double complex) * subset_size);
+
+  for (int64_t segment = 0; segment < segments; segment++) {
+    scatter_dif(data, &place);
+    msg_requests reqs = post_child_receives(data, &place, 0, NULL);
+
+    // Both spectra are in the same bit reversed order, which is exactly what
+    // the inverse decimation-in-time FFT expects.
+    for (int64_t j = 0; j < subset_size; j++)
+      data[data_start + j] *= kernel[j];
+
+    log_msg(LOG_DEBUG, "Starting inital FFT calculation.");
+    fft(&data[data_start], subset_size, true);
+    log_msg(LOG_DEBUG, "Finished inital FFT calculation.");
+
+    merge_results(data, reqs, &place, true, NULL, 0, NULL, NULL);
+    if (result_dest == 0) send_results(data, result_size, result_dest);
+  }
+
+  arena_free(&mem);
+}
+
+void out_of_core_node(const char* inname, const char* outname, size_t memory,
+                      bool inverse, enum arena_pages pages) {
+  int node_id = get_node_id();
+  if (node_id == 0) {
+    int64_t N = ooc_size(inname);
+    if (N < 0) {
+      log_msg(LOG_FATAL, "Unable to read input file: %s", inname);
+      msg_abort();
+    }
+    if (ooc_create(outname, N) != 0) {
+      log_msg(LOG_FATAL, "Unable to create output file: %s", outname);
+      msg_abort();
+    }
+  }
+
+  // The files are on the head node's disk, only its host can reach them
+  int local_id, local_count = head_host_nodes(&local_id);
+  msg_barrier();
+  ooc_plan plan = NULL;
+  if (local_id >= 0) {
+    plan = ooc_init(inname, outname, memory, inverse, pages);
+    if (plan == NULL) {
+      log_msg(LOG_FATAL, "Unable to plan out-of-core transform within %zu "
+              "bytes.", memory);
+      msg_abort();
+    }
+    int64_t rows, columns;
+    ooc_shape(plan, &rows, &columns);
+    log_msg(LOG_DEBUG, "Out-of-core transform is %" PRId64 " x %" PRId64 ".",
+            rows, columns);
+  }
+  if (node_id == 0) {
+    log_msg(LOG__INFO, "Transforming out-of-core on %i node(s).", local_count);
+  }
+
+  for (int pass = 0; pass < OOC_PASSES; pass++) {
+    if (plan != NULL) {
+      int64_t width, blocks = ooc_blocks(plan, pass, &width);
+      if (node_id == 0) {
+        log_msg(LOG__INFO,
+                "Pass %i in %" PRId64 " block(s) of %" PRId64 " column(s).",
+                pass + 1, blocks, width);
+      }
+      if (ooc_pass(plan, pass, local_id, local_count) != 0) {
+        log_msg(LOG_FATAL, "Unable to read or write pass %i.", pass + 1);
+        msg_abort();
+      }
+    }
+    msg_barrier();
+  }
+
+  ooc_free(&plan);
+  if (node_id == 0) ooc_remove(outname);
+}
@@ -0,0 +1,303 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+#define M_TAU 6.28318530717958647692
+#define MIN_SIZE 4
+#define IO_SLOTS 3              // Being read, being transformed, being written
+#define MAX_REQUEST (1L << 26)  // Most values in a single read or write
+#define IO_REQUESTS 64          // Most reads or writes in flight per slot
+
+#include "ooc.h"
+
+#include <aio.h>
+#include <complex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fft.h"
+
+// A buffer holding one block of columns and the reads or writes moving it.
+// Requests are reused in a ring, started ones past done are still in flight.
+struct io_slot {
+  double complex *buffer;
+  struct aiocb *requests;
+  int64_t started, done;
+  bool write;
+};
+
+struct ooc_plan_s {
+  int in, tmp, out;
+  int64_t N, rows, columns;
+  int64_t width[OOC_PASSES];  // Columns in each block of a pass
+  bool padded;                // The input file is shorter than N
+  bool inverse;
+  arena mem;
+  double complex *work;  // The columns of the current block, one after another
+  struct io_slot slots[IO_SLOTS];
+};
+
+static char *tmp_name(const char *outname) {
+  char *name = malloc(strlen(outname) + sizeof(".tmp"));
+  strcpy(name, outname);
+  strcat(name, ".tmp");
+  return name;
+}
+
+static int64_t file_values(int fd) {
+  struct stat info;
+  if (fstat(fd, &info) != 0) return -1;
+  return info.st_size / sizeof(double complex);
+}
+
+int64_t ooc_size(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  int64_t values = file_values(fd);
+  close(fd);
+  if (values < 0) return -1;
+
+  int64_t N = MIN_SIZE;
+  while (N < values) N *= 2;
+  return N;
+}
+
+static int create_file(const char *filename, int64_t N) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return -1;
+  int status = ftruncate(fd, N * sizeof(double complex));
+  return close(fd) != 0 ? -1 : status;
+}
+
+int ooc_create(const char *outname, int64_t N) {
+  char *tmpname = tmp_name(outname);
+  int status = create_file(outname, N) | create_file(tmpname, N);
+  free(tmpname);
+  return status;
+}
+
+void ooc_remove(const char *outname) {
+  char *tmpname = tmp_name(outname);
+  unlink(tmpname);
+  free(tmpname);
+}
+
+// The number of values in each column of a pass, its FFT size.
+static int64_t column_size(ooc_plan plan, int pass) {
+  return pass == 0 ? plan->rows : plan->columns;
+}
+
+// The number of columns in a pass, the distance between rows.
+static int64_t row_size(ooc_plan plan, int pass) {
+  return pass == 0 ? plan->columns : plan->rows;
+}
+
+ooc_plan ooc_init(const char *inname, const char *outname, size_t memory,
+                  bool inverse, enum arena_pages pages) {
+  ooc_plan plan = calloc(1, sizeof(struct ooc_plan_s));
+  char *tmpname = tmp_name(outname);
+  plan->in = open(inname, O_RDONLY);
+  plan->tmp = open(tmpname, O_RDWR);
+  plan->out = open(outname, O_WRONLY);
+  free(tmpname);
+  int64_t values = plan->in < 0 ? -1 : file_values(plan->in);
+  plan->N = ooc_size(inname);
+  if (plan->tmp < 0 || plan->out < 0 || values < 0 || plan->N < 0) {
+    ooc_free(&plan);
+    return NULL;
+  }
+  plan->padded = values < plan->N;
+  plan->inverse = inverse;
+
+  // Columns are at least as long as rows
+  plan->columns = 1;
+  while (plan->columns * plan->columns * 2 <= plan->N) plan->columns *= 2;
+  plan->rows = plan->N / plan->columns;
+
+  // The arena is rounded up to whole pages, so the cap is rounded down to
+  // them first. A cap below one huge page is met with normal pages instead.
+  if (arena_fit(memory, pages) == 0) pages = ARENA_PAGES_NORMAL;
+  memory = arena_fit(memory, pages);
+
+  // Every slot and the work buffer hold a block and its alignment padding,
+  // widths are powers of two so they always divide the number of columns
+  size_t request_bytes = IO_SLOTS * arena_size(IO_REQUESTS *
+                                               sizeof(struct aiocb));
+  size_t available = memory > request_bytes ? memory - request_bytes : 0;
+  size_t buffer_bytes = available / (IO_SLOTS + 1);
+  buffer_bytes = buffer_bytes > arena_size(0) ? buffer_bytes - arena_size(0)
+                                              : 0;
+  int64_t block = 0;
+  for (int pass = 0; pass < OOC_PASSES; pass++) {
+    int64_t size = column_size(plan, pass), width = 1;
+    size_t limit = buffer_bytes / (sizeof(double complex) * size);
+    while (width * 2 <= limit && width * 2 <= row_size(plan, pass) &&
+           width * 2 <= MAX_REQUEST)
+      width *= 2;
+    if (width > limit) {
+      ooc_free(&plan);
+      return NULL;
+    }
+    plan->width[pass] = width;
+    if (size * width > block) block = size * width;
+  }
+
+  size_t bytes = block * sizeof(double complex);
+  plan->mem = arena_init((IO_SLOTS + 1) * arena_size(bytes) + request_bytes,
+                         pages);
+  if (plan->mem == NULL) {
+    ooc_free(&plan);
+    return NULL;
+  }
+  plan->work = arena_alloc(plan->mem, bytes);
+  for (int i = 0; i < IO_SLOTS; i++) {
+    plan->slots[i].buffer = arena_alloc(plan->mem, bytes);
+    plan->slots[i].requests =
+        arena_alloc(plan->mem, IO_REQUESTS * sizeof(struct aiocb));
+  }
+  return plan;
+}
+
+void ooc_shape(ooc_plan plan, int64_t *rows, int64_t *columns) {
+  *rows = plan->rows;
+  *columns = plan->columns;
+}
+
+int64_t ooc_blocks(ooc_plan plan, int pass, int64_t *width) {
+  *width = plan->width[pass];
+  return row_size(plan, pass) / plan->width[pass];
+}
+
+// Waits for the oldest request of a slot still in flight. Reads may come up
+// short at the end of the input, which leaves the zeros it is padded with.
+static int finish_request(struct io_slot *slot) {
+  struct aiocb *request = &slot->requests[slot->done++ % IO_REQUESTS];
+  const struct aiocb *waiting = request;
+  while (aio_error(request) == EINPROGRESS) aio_suspend(&waiting, 1, NULL);
+  ssize_t done = aio_return(request);
+  return done < 0 || (slot->write && done < request->aio_nbytes) ? -1 : 0;
+}
+
+// Waits for every request of a slot.
+static int finish_io(struct io_slot *slot) {
+  int status = 0;
+  while (slot->done < slot->started) status |= finish_request(slot);
+  return status;
+}
+
+// Starts moving count segments of length values between the buffer, where they
+// are packed together, and the file, where they are stride values apart.
+// Segments that are next to each other in the file are moved together. Once
+// IO_REQUESTS are in flight the oldest is waited for before starting another.
+static int start_io(struct io_slot *slot, int fd, bool write, int64_t start,
+                    int64_t count, int64_t length, int64_t stride) {
+  int64_t group = stride == length ? MAX_REQUEST / length : 1;
+  if (group < 1) group = 1;
+  slot->write = write;
+  slot->started = slot->done = 0;
+  for (int64_t i = 0; i < count; i += group) {
+    if (slot->started - slot->done == IO_REQUESTS &&
+        finish_request(slot) != 0)
+      return -1;
+    int64_t segments = count - i < group ? count - i : group;
+    struct aiocb *request = &slot->requests[slot->started % IO_REQUESTS];
+    memset(request, 0, sizeof(struct aiocb));
+    request->aio_fildes = fd;
+    request->aio_buf = &slot->buffer[i * length];
+    request->aio_nbytes = segments * length * sizeof(double complex);
+    request->aio_offset = (start + i * stride) * sizeof(double complex);
+    if ((write ? aio_write(request) : aio_read(request)) != 0) return -1;
+    slot->started++;
+  }
+  return 0;
+}
+
+static int read_block(ooc_plan plan, int pass, int64_t block,
+                      struct io_slot *slot) {
+  int64_t size = column_size(plan, pass), width = plan->width[pass];
+  if (pass == 0 && plan->padded)
+    memset(slot->buffer, 0, size * width * sizeof(double complex));
+  return start_io(slot, pass == 0 ? plan->in : plan->tmp, false,
+                  block * width, size, width, row_size(plan, pass));
+}
+
+// The first pass writes each column as a row of the temporary file, the second
+// writes them back as columns of the output.
+static int write_block(ooc_plan plan, int pass, int64_t block,
+                       struct io_slot *slot) {
+  int64_t size = column_size(plan, pass), width = plan->width[pass];
+  if (pass == 0)
+    return start_io(slot, plan->tmp, true, block * width * size, width, size,
+                    size);
+  return start_io(slot, plan->out, true, block * width, size, width,
+                  row_size(plan, pass));
+}
+
+// Transforms the columns of a block in place, the buffer holds them row by row.
+static void transform_block(ooc_plan plan, int pass, int64_t block,
+                            double complex *buffer) {
+  int64_t size = column_size(plan, pass), width = plan->width[pass];
+  int sign = plan->inverse ? 1 : -1;
+  for (int64_t b = 0; b < width; b++) {
+    double complex *column = &plan->work[b * size];
+    for (int64_t r = 0; r < size; r++) column[r] = buffer[r * width + b];
+    bit_reversal_permutation(column, size);
+    fft(column, size, plan->inverse);
+
+    if (pass == 0) {
+      // Twiddle factors of the four-step decomposition, reduced so the angle
+      // stays accurate for large N
+      int64_t c = block * width + b;
+      for (int64_t k = 1; k < size; k++)
+        column[k] *= cexp(sign * I * M_TAU * (c * k % plan->N) / plan->N);
+    } else if (plan->inverse) {
+      for (int64_t k = 0; k < size; k++) column[k] /= plan->N;
+    }
+  }
+
+  if (pass == 0) {
+    memcpy(buffer, plan->work, size * width * sizeof(double complex));
+    return;
+  }
+  for (int64_t b = 0; b < width; b++)
+    for (int64_t k = 0; k < size; k++)
+      buffer[k * width + b] = plan->work[b * size + k];
+}
+
+int ooc_pass(ooc_plan plan, int pass, int64_t first, int64_t step) {
+  int64_t width, blocks = ooc_blocks(plan, pass, &width);
+  int64_t count = first < blocks ? (blocks - first + step - 1) / step : 0;
+  if (count == 0) return 0;
+
+  int status = read_block(plan, pass, first, &plan->slots[0]);
+  for (int64_t i = 0; i < count && status == 0; i++) {
+    struct io_slot *slot = &plan->slots[i % IO_SLOTS];
+    if (i + 1 < count) {
+      // Prefetch the next block once the slot it goes in is written out
+      struct io_slot *next = &plan->slots[(i + 1) % IO_SLOTS];
+      status |= finish_io(next);
+      status |= read_block(plan, pass, first + (i + 1) * step, next);
+    }
+    status |= finish_io(slot);
+    if (status != 0) break;
+    transform_block(plan, pass, first + i * step, slot->buffer);
+    status |= write_block(plan, pass, first + i * step, slot);
+  }
+
+  for (int i = 0; i < IO_SLOTS; i++) status |= finish_io(&plan->slots[i]);
+  return status;
+}
+
+void ooc_free(ooc_plan *plan) {
+  if (*plan == NULL) return;
+  if ((*plan)->in >= 0) close((*plan)->in);
+  if ((*plan)->tmp >= 0) close((*plan)->tmp);
+  if ((*plan)->out >= 0) close((*plan)->out);
+  if ((*plan)->mem != NULL) arena_free(&(*plan)->mem);
+  free(*plan);
+  *plan = NULL;
+}
@@ -6,7 +6,10 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "codelets.h"
+#include "fft.h"
 #include "messaging.h"
 
 void print_help(const char *invocation) {
@@ -19,22 +22,108 @@ void print_help(const char *invocation) {
       "-d\tIgnore the first line or header of [FILE]\n"
       "-i\tCalculate the inverse FFT\n"
       "-f\tCalculate the forward FFT (default)\n"
-      "\n", invocation);
+      "-c FILE\tConvolve [FILE] with the kernel in FILE\n"
+      "-x FILE\tCross-correlate [FILE] with the kernel in FILE\n"
+      "-b #\tUse overlap-save with blocks of # for -c and -x, must be a power "
+      "of two\n"
+      "-p TYPE\tOutput mag, power or db of the spectrum instead\n"
+      "-e #\tOutput the energy of each band of # bins instead\n"
+      "-k #\tOutput the # strongest bins instead, as bin,real,imag\n"
+      "-r BINS\tOnly compute and output the given bins, a comma separated "
+      "list\n\tof bins or inclusive ranges, eg. 5,10:20\n"
+      "-L #\tSet the codelet leaf size to #, a power of two up to %i, default "
+      "is %i\n"
+      "-H #\tBack node buffers with 0 normal pages, 1 transparent huge pages\n"
+      "\t(default) or 2 explicit huge pages\n"
+      "-S\tShare result buffers between nodes on the same host instead of\n"
+      "\tsending results through messages\n"
+      "-t\tBuild the communication tree around which nodes share a host\n"
+      "-m FILE\tRead which host each node runs on from a hostfile or rankfile\n"
+      "\tinstead of detecting it\n"
+      "-n\tPrint the communication tree and its modeled cost and exit\n"
+      "-a\tMeasure the system and only use as many nodes as pay off, small\n"
+      "\ttransforms are done by the head node alone\n"
+      "-O FILE\tTransform [FILE] out-of-core, both it and FILE are binary\n"
+      "-M #\tLimit the buffers of -O to # MiB on each node, default is %i\n"
+      "\n", invocation, MAX_CODELET_SIZE, DEFAULT_LEAF_SIZE,
+      OOC_DEFAULT_MEMORY);
+}
+
+static int compare_bins(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Parses a comma separated list of bins and inclusive ranges into a sorted
+// array without duplicates. Returns the number of bins or -1 if invalid.
+static int parse_bins(const char *spec, int64_t **bins) {
+  int count = 0, allocated = 16;
+  *bins = malloc(sizeof(int64_t) * allocated);
+  const char *c = spec;
+  while (*c != '\0') {
+    char *end;
+    long long lo = strtoll(c, &end, 10), hi = lo;
+    if (end == c || lo < 0) break;
+    if (*end == ':') {
+      c = end + 1;
+      hi = strtoll(c, &end, 10);
+      if (end == c || hi < lo) break;
+    }
+    for (long long bin = lo; bin <= hi; bin++) {
+      if (count == allocated)
+        *bins = realloc(*bins, sizeof(int64_t) * (allocated *= 2));
+      (*bins)[count++] = bin;
+    }
+    c = end;
+    if (*c == ',')
+      c++;
+    else if (*c != '\0')
+      break;
+  }
+  if (*c != '\0' || count == 0) {
+    free(*bins);
+    *bins = NULL;
+    return -1;
+  }
+
+  qsort(*bins, count, sizeof(int64_t), compare_bins);
+  int unique = 0;
+  for (int i = 0; i < count; i++)
+    if (unique == 0 || (*bins)[unique - 1] != (*bins)[i])
+      (*bins)[unique++] = (*bins)[i];
+  return unique;
 }
 
 void default_options(struct breakwater_options *bopts) {
   bopts->loglvl = 4;
   bopts->style = 1;
   bopts->infilename = NULL;
+  bopts->kernelfilename = NULL;
+  bopts->outfilename = NULL;
   bopts->header = false;
   bopts->inverse = false;
+  bopts->correlate = false;
+  bopts->blocksize = 0;
+  bopts->reduce.type = REDUCE_NONE;
+  bopts->reduce.param = 0;
+  bopts->bins = NULL;
+  bopts->bincount = 0;
+  bopts->leafsize = DEFAULT_LEAF_SIZE;
+  bopts->pages = ARENA_PAGES_TRANSPARENT;
+  bopts->shared = false;
+  bopts->tree.topology = false;
+  bopts->tree.hostfile = NULL;
+  bopts->tree.dry_run = false;
+  bopts->tree.auto_size = false;
+  bopts->memory = (size_t)OOC_DEFAULT_MEMORY << 20;
 }
 
 void process_options(int argc, char *argv[], struct breakwater_options *bopts,
                      int node_id) {
   int temp = 0, carg;
   default_options(bopts);
-  while ((carg = getopt(argc, argv, "hl:dif")) != -1) {
+  while ((carg = getopt(argc, argv, "hl:difc:x:b:p:e:k:r:L:H:Stm:naO:M:")) !=
+         -1) {
     switch (carg) {
       case 'h':
         if (node_id == 0) print_help(argv[0]);
@@ -64,6 +153,125 @@ void process_options(int argc, char *argv[], struct breakwater_options *bopts,
         bopts->inverse = false;
         break;
 
+      case 'c':
+        bopts->kernelfilename = optarg;
+        bopts->correlate = false;
+        break;
+
+      case 'x':
+        bopts->kernelfilename = optarg;
+        bopts->correlate = true;
+        break;
+
+      case 'b':
+        bopts->blocksize = strtoll(optarg, NULL, 10);
+        if (bopts->blocksize < 2 ||
+            (bopts->blocksize & (bopts->blocksize - 1)) != 0) {
+          if (node_id == 0)
+            fprintf(stderr, "Error: invalid block size: %s\n", optarg);
+          msg_finalize();
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'p':
+        if (strcmp(optarg, "mag") == 0)
+          bopts->reduce.type = REDUCE_MAGNITUDE;
+        else if (strcmp(optarg, "power") == 0)
+          bopts->reduce.type = REDUCE_POWER;
+        else if (strcmp(optarg, "db") == 0)
+          bopts->reduce.type = REDUCE_DECIBEL;
+        else {
+          if (node_id == 0)
+            fprintf(stderr, "Error: invalid spectrum type: %s\n", optarg);
+          msg_finalize();
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'e':
+      case 'k':
+        temp = strtol(optarg, NULL, 10);
+        if (temp < 1) {
+          if (node_id == 0)
+            fprintf(stderr, "Error: invalid %s: %s\n",
+                    carg == 'e' ? "band size" : "peak count", optarg);
+          msg_finalize();
+          exit(EXIT_FAILURE);
+        }
+        bopts->reduce.type = carg == 'e' ? REDUCE_BANDS : REDUCE_PEAKS;
+        bopts->reduce.param = temp;
+        break;
+
+      case 'r':
+        free(bopts->bins);
+        bopts->bincount = parse_bins(optarg, &bopts->bins);
+        if (bopts->bincount < 0) {
+          if (node_id == 0)
+            fprintf(stderr, "Error: invalid bins: %s\n", optarg);
+          msg_finalize();
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'L':
+        temp = strtol(optarg, NULL, 10);
+        if (temp < 1 || temp > MAX_CODELET_SIZE || (temp & (temp - 1)) != 0) {
+          if (node_id == 0)
+            fprintf(stderr, "Error: invalid leaf size: %s\n", optarg);
+          msg_finalize();
+          exit(EXIT_FAILURE);
+        }
+        bopts->leafsize = temp;
+        break;
+
+      case 'H':
+        temp = strtol(optarg, NULL, 10);
+        if (temp < ARENA_PAGES_NORMAL || temp > ARENA_PAGES_HUGE ||
+            (temp == 0 && optarg[0] != '0')) {
+          if (node_id == 0)
+            fprintf(stderr, "Error: invalid page type: %s\n", optarg);
+          msg_finalize();
+          exit(EXIT_FAILURE);
+        }
+        bopts->pages = temp;
+        break;
+
+      case 'S':
+        bopts->shared = true;
+        break;
+
+      case 't':
+        bopts->tree.topology = true;
+        break;
+
+      case 'm':
+        bopts->tree.hostfile = optarg;
+        break;
+
+      case 'n':
+        bopts->tree.dry_run = true;
+        break;
+
+      case 'a':
+        bopts->tree.auto_size = true;
+        break;
+
+      case 'O':
+        bopts->outfilename = optarg;
+        break;
+
+      case 'M':
+        temp = strtol(optarg, NULL, 10);
+        if (temp < 1) {
+          if (node_id == 0)
+            fprintf(stderr, "Error: invalid memory limit: %s\n", optarg);
+          msg_finalize();
+          exit(EXIT_FAILURE);
+        }
+        bopts->memory = (size_t)temp << 20;
+        break;
+
       case '?':
         // Error message already printed out
         msg_finalize();
@@ -75,4 +283,24 @@ void process_options(int argc, char *argv[], struct breakwater_options *bopts,
   }
 
   bopts->infilename = argv[optind];
+
+  if (bopts->kernelfilename != NULL &&
+      (bopts->inverse || bopts->reduce.type != REDUCE_NONE ||
+       bopts->bincount > 0 || bopts->shared)) {
+    if (node_id == 0)
+      fprintf(stderr,
+              "Error: -c and -x cannot be combined with -i, -r, -S or a "
+              "reduction\n");
+    msg_finalize();
+    exit(EXIT_FAILURE);
+  }
+
+  if (bopts->outfilename != NULL &&
+      (bopts->kernelfilename != NULL || bopts->reduce.type != REDUCE_NONE ||
+       bopts->bincount > 0)) {
+    if (node_id == 0)
+      fprintf(stderr, "Error: -O only supports the plain transform\n");
+    msg_finalize();
+    exit(EXIT_FAILURE);
+  }
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+#include "reduce.h"
+
+#include <float.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+
+static double power(double complex x) {
+  return creal(x) * creal(x) + cimag(x) * cimag(x);
+}
+
+int64_t reduced_size(struct reduction reduce, int64_t N) {
+  switch (reduce.type) {
+    case REDUCE_BANDS:
+      return (N + reduce.param - 1) / reduce.param;
+    case REDUCE_PEAKS:
+      return 3 * (reduce.param < N ? reduce.param : N);
+    default:
+      return N;
+  }
+}
+
+// Keeps the K strongest bins in a binary min-heap so each bin costs at most
+// O(log K), the weakest of the current peaks always sits at the root. The heap
+// lives in the output itself, entry i being the bin at 3 * i and its power at
+// 3 * i + 1, so no more memory is needed than the result takes.
+static void swap_entries(double heap[], int64_t a, int64_t b) {
+  for (int j = 0; j < 2; j++) {
+    double temp = heap[3 * a + j];
+    heap[3 * a + j] = heap[3 * b + j];
+    heap[3 * b + j] = temp;
+  }
+}
+
+static void sift_down(double heap[], int64_t size, int64_t i) {
+  while (2 * i + 1 < size) {
+    int64_t child = 2 * i + 1;
+    if (child + 1 < size && heap[3 * child + 4] < heap[3 * child + 1]) child++;
+    if (heap[3 * i + 1] <= heap[3 * child + 1]) return;
+    swap_entries(heap, i, child);
+    i = child;
+  }
+}
+
+static void find_peaks(double complex X[], int64_t N, int64_t K,
+                       double out[]) {
+  for (int64_t i = 0; i < K; i++) {
+    out[3 * i] = i;
+    out[3 * i + 1] = power(X[i]);
+  }
+  for (int64_t i = K / 2 - 1; i >= 0; i--) sift_down(out, K, i);
+  for (int64_t i = K; i < N; i++) {
+    double p = power(X[i]);
+    if (p <= out[1]) continue;
+    out[0] = i;
+    out[1] = p;
+    sift_down(out, K, 0);
+  }
+
+  // Popping the root repeatedly gives increasing order, each peak goes in the
+  // entry the heap just gave up at its back
+  for (int64_t size = K; size > 0; size--) {
+    int64_t bin = (int64_t)out[0];
+    swap_entries(out, 0, size - 1);
+    sift_down(out, size - 1, 0);
+    out[3 * (size - 1)] = bin;
+    out[3 * (size - 1) + 1] = creal(X[bin]);
+    out[3 * (size - 1) + 2] = cimag(X[bin]);
+  }
+}
+
+void reduce_spectrum(double complex X[], int64_t N, struct reduction reduce,
+                     double out[]) {
+  switch (reduce.type) {
+    case REDUCE_MAGNITUDE:
+      for (int64_t i = 0; i < N; i++) out[i] = cabs(X[i]);
+      break;
+
+    case REDUCE_POWER:
+      for (int64_t i = 0; i < N; i++) out[i] = power(X[i]);
+      break;
+
+    case REDUCE_DECIBEL:
+      // Empty bins get the smallest power instead of -inf
+      for (int64_t i = 0; i < N; i++)
+        out[i] = 10 * log10(fmax(power(X[i]), DBL_MIN));
+      break;
+
+    case REDUCE_BANDS:
+      for (int64_t i = 0; i < reduced_size(reduce, N); i++) out[i] = 0;
+      for (int64_t i = 0; i < N; i++) out[i / reduce.param] += power(X[i]);
+      break;
+
+    case REDUCE_PEAKS:
+      find_peaks(X, N, reduced_size(reduce, N) / 3, out);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void print_reduced(double out[], int64_t size, struct reduction reduce) {
+  if (reduce.type == REDUCE_PEAKS) {
+    for (int64_t i = 0; i < size; i += 3)
+      printf("%" PRId64 ",%f,%f\n", (int64_t)out[i], out[i + 1], out[i + 2]);
+  } else {
+    for (int64_t i = 0; i < size; i++) printf("%f\n", out[i]);
+  }
+}
@@ -0,0 +1,363 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+#include "tree.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fft.h"
+
+#define MAX_LINE_SIZE 256
+#define MAX_HOST_SIZE 256
+
+// A result sent between hosts always costs more than any number of elements,
+// so the number of transfers is minimized first and their size second.
+#define CROSS_HOST_COST (1LL << 40)
+
+void subset_offsets(int64_t offsets[], int64_t parts[], int nodes) {
+  int64_t data_start = 0;
+  for (int i = 0; i < nodes; i++) {
+    offsets[i] = data_start;
+    data_start += parts[i];
+  }
+}
+
+static int log2_int(int64_t n) {
+  int l = 0;
+  while (((int64_t)1 << l) < n) l++;
+  return l;
+}
+
+// Butterflies done by a node with a subset of size n that ends up holding a
+// block of size size, its own FFT plus one merge for each doubling.
+static int64_t path_work(int64_t n, int64_t size) {
+  return n / 2 * log2_int(n) + (size - n);
+}
+
+struct tree_plan {
+  int64_t *slices;       // Size of the subset at each position
+  int64_t *slice_start;  // Where each position's subset starts
+  int *host;             // Host of the node at each position
+  int count;         // Number of positions with a subset
+  long long *cost;   // Cost of each position holding its block, per depth
+  int host_count;
+};
+
+// Finds the first position of the back half of a block starting at lo.
+static int block_middle(struct tree_plan *plan, int lo, int hi,
+                        int64_t size) {
+  int mid = lo;
+  while (mid < hi && plan->slice_start[mid] < plan->slice_start[lo] + size / 2)
+    mid++;
+  return mid;
+}
+
+// Fills in the lowest cost of each position in [lo, hi) ending up with the
+// whole block, merging the results of one half into the other. The holder of
+// the other half only needs to be on the cheapest host for it.
+static void plan_block(struct tree_plan *plan, int lo, int hi, int64_t size,
+                       int depth) {
+  long long *cost = &plan->cost[depth * plan->count];
+  if (hi - lo == 1) {
+    cost[lo] = 0;
+    return;
+  }
+  int mid = block_middle(plan, lo, hi, size);
+  plan_block(plan, lo, mid, size / 2, depth + 1);
+  plan_block(plan, mid, hi, size / 2, depth + 1);
+  long long *half = &plan->cost[(depth + 1) * plan->count];
+
+  long long best[2][plan->host_count];
+  long long lowest[2] = {LLONG_MAX, LLONG_MAX};
+  for (int h = 0; h < plan->host_count; h++)
+    best[0][h] = best[1][h] = LLONG_MAX;
+  for (int p = lo; p < hi; p++) {
+    int side = p >= mid;
+    long long *host_best = &best[side][plan->host[p]];
+    if (half[p] < *host_best) *host_best = half[p];
+    if (half[p] < lowest[side]) lowest[side] = half[p];
+  }
+  long long cross = CROSS_HOST_COST + size / 2;
+  for (int p = lo; p < hi; p++) {
+    int other = p < mid;
+    long long merge = best[other][plan->host[p]];
+    if (lowest[other] + cross < merge) merge = lowest[other] + cross;
+    cost[p] = half[p] + merge;
+  }
+}
+
+// Picks the cheapest position in [lo, hi) to hold a block of the given size
+// and send it to a node on host, ties going to the one with the least work.
+// A host of -1 means the block goes to the head node.
+static int pick_holder(struct tree_plan *plan, int lo, int hi, int64_t size,
+                       int depth, int host) {
+  long long *cost = &plan->cost[depth * plan->count];
+  int holder = lo;
+  long long holder_cost = LLONG_MAX;
+  for (int p = lo; p < hi; p++) {
+    long long c = cost[p];
+    if (host >= 0 && plan->host[p] != host) c += CROSS_HOST_COST + size;
+    if (c < holder_cost ||
+        (c == holder_cost && path_work(plan->slices[p], size) <
+                                 path_work(plan->slices[holder], size))) {
+      holder = p;
+      holder_cost = c;
+    }
+  }
+  return holder;
+}
+
+// Walks back down the plan from the node holding the whole block, picking the
+// node that holds the other half of each merge and sends it to the holder.
+static void assign_block(struct tree_plan *plan, int lo, int hi, int64_t size,
+                         int depth, int holder, int64_t dest_size[],
+                         int dest_pos[]) {
+  if (hi - lo == 1) return;
+  int mid = block_middle(plan, lo, hi, size);
+  int other_lo = holder < mid ? mid : lo;
+  int other_hi = holder < mid ? hi : mid;
+  int other = pick_holder(plan, other_lo, other_hi, size / 2, depth + 1,
+                          plan->host[holder]);
+  dest_size[other] = size / 2;
+  dest_pos[other] = holder;
+  assign_block(plan, other_lo, other_hi, size / 2, depth + 1, other, dest_size,
+               dest_pos);
+  if (holder < mid)
+    assign_block(plan, lo, mid, size / 2, depth + 1, holder, dest_size,
+                 dest_pos);
+  else
+    assign_block(plan, mid, hi, size / 2, depth + 1, holder, dest_size,
+                 dest_pos);
+}
+
+void topology_targets(int64_t N, int active, int64_t parts[],
+                      int64_t offsets[], int64_t result_size[],
+                      int result_dest[], int hosts[], int nodes) {
+  // Number the hosts from 0 and count their nodes
+  int host[nodes], host_nodes[nodes];
+  int host_count = 0;
+  for (int i = 0; i < nodes; i++) {
+    host[i] = host_count;
+    for (int j = 0; j < i; j++) {
+      if (hosts[j] == hosts[i]) {
+        host[i] = host[j];
+        break;
+      }
+    }
+    if (host[i] == host_count) host_nodes[host_count++] = 0;
+    host_nodes[host[i]]++;
+  }
+
+  // Hosts with the most nodes come first so they get the largest aligned
+  // blocks of neighbouring subsets, any nodes left over go without.
+  int order[nodes];
+  for (int i = 0; i < nodes; i++) order[i] = i;
+  for (int i = 1; i < nodes; i++) {
+    int node = order[i], j = i;
+    for (; j > 0; j--) {
+      int prev = order[j - 1];
+      if (host_nodes[host[prev]] > host_nodes[host[node]]) break;
+      if (host_nodes[host[prev]] == host_nodes[host[node]] &&
+          host[prev] <= host[node])
+        break;
+      order[j] = prev;
+    }
+    order[j] = node;
+  }
+
+  int64_t slices[active];
+  partition_pow2(N, slices, active);
+  int first = 0;
+  while (slices[first] == 0) first++;
+  int count = active - first;
+
+  struct tree_plan plan = {.count = count, .host_count = host_count};
+  int64_t slice_start[count];
+  int slice_host[count];
+  plan.slices = &slices[first];
+  plan.slice_start = slice_start;
+  plan.host = slice_host;
+  subset_offsets(slice_start, plan.slices, count);
+  for (int p = 0; p < count; p++) slice_host[p] = host[order[p]];
+  int depths = log2_int(N / plan.slices[0]) + 1;
+  plan.cost = malloc(sizeof(long long) * depths * count);
+
+  int64_t dest_size[count];
+  int dest_pos[count];
+  plan_block(&plan, 0, count, N, 0);
+  int root = pick_holder(&plan, 0, count, N, 0, -1);
+  dest_size[root] = N;
+  dest_pos[root] = -1;
+  assign_block(&plan, 0, count, N, 0, root, dest_size, dest_pos);
+  free(plan.cost);
+
+  memset(parts, 0, sizeof(int64_t) * nodes);
+  memset(offsets, 0, sizeof(int64_t) * nodes);
+  memset(result_size, 0, sizeof(int64_t) * nodes);
+  memset(result_dest, 0, sizeof(int) * nodes);
+  for (int p = 0; p < count; p++) {
+    int node = order[p];
+    parts[node] = plan.slices[p];
+    offsets[node] = slice_start[p];
+    result_size[node] = dest_size[p];
+    result_dest[node] = dest_pos[p] < 0 ? 0 : order[dest_pos[p]] + 1;
+  }
+}
+
+void tree_cost(struct tree_cost *cost, int64_t parts[], int64_t result_size[],
+               int result_dest[], int hosts[], int nodes) {
+  memset(cost, 0, sizeof(struct tree_cost));
+  int64_t largest = 0;
+  for (int i = 0; i < nodes; i++) {
+    if (parts[i] == 0) continue;
+    int64_t work = path_work(parts[i], result_size[i]);
+    if (work > cost->max_work) cost->max_work = work;
+    if (result_size[i] > largest) largest = result_size[i];
+    int dest = result_dest[i];
+    if (dest == 0) continue;
+    if (hosts[dest - 1] != hosts[i]) {
+      cost->cross_transfers++;
+      cost->cross_elements += result_size[i];
+    } else {
+      cost->local_transfers++;
+      cost->local_elements += result_size[i];
+    }
+  }
+
+  // Children always send smaller results than their parents, so finishing
+  // times can be worked out from the smallest results up.
+  int64_t finish[nodes];
+  for (int64_t size = 1; size <= largest; size *= 2) {
+    for (int i = 0; i < nodes; i++) {
+      if (parts[i] == 0 || result_size[i] != size) continue;
+      finish[i] = path_work(parts[i], parts[i]);
+      for (int64_t n = parts[i]; n < size; n *= 2) {
+        for (int j = 0; j < nodes; j++) {
+          if (parts[j] == 0 || result_dest[j] != i + 1 || result_size[j] != n)
+            continue;
+          if (finish[j] > finish[i]) finish[i] = finish[j];
+        }
+        finish[i] += n;
+      }
+      if (result_dest[i] == 0) cost->critical_path = finish[i];
+    }
+  }
+}
+
+double model_time(int64_t N, int active, struct cost_model model) {
+  if (active == 0) return path_work(N, N) * model.butterfly_time;
+
+  int64_t parts[active], result_size[active];
+  int result_dest[active], hosts[active];
+  partition_pow2(N, parts, active);
+  result_targets(result_size, result_dest, parts, active);
+  memset(hosts, 0, sizeof(hosts));
+  struct tree_cost cost;
+  tree_cost(&cost, parts, result_size, result_dest, hosts, active);
+
+  // The last node receives every merge on the longest chain
+  int64_t root_part = parts[active - 1];
+  int merges = log2_int(N / root_part);
+  double scatter = active * model.latency + N * model.element_time;
+  double merge = merges * model.latency + (N - root_part) * model.element_time;
+  double gather = model.latency + N * model.element_time;
+  return scatter + cost.critical_path * model.butterfly_time + merge + gather;
+}
+
+int pick_node_count(int64_t N, int nodes, struct cost_model model,
+                    bool serial) {
+  // Nodes past N / 2 would only be left without a subset
+  int most = nodes < N / 2 ? nodes : (int)(N / 2);
+  int best = serial ? 0 : 1;
+  double best_time = model_time(N, best, model);
+  for (int active = best + 1; active <= most; active++) {
+    double time = model_time(N, active, model);
+    if (time < best_time) {
+      best = active;
+      best_time = time;
+    }
+  }
+  return best;
+}
+
+void print_tree(int64_t parts[], int64_t offsets[], int64_t result_size[],
+                int result_dest[], int hosts[], int nodes) {
+  printf("node,host,subset,offset,result,dest\n");
+  for (int i = 0; i < nodes; i++)
+    printf("%i,%i,%" PRId64 ",%" PRId64 ",%" PRId64 ",%i\n", i + 1, hosts[i],
+           parts[i], offsets[i], result_size[i], result_dest[i]);
+
+  struct tree_cost cost;
+  tree_cost(&cost, parts, result_size, result_dest, hosts, nodes);
+  printf("cross-host transfers: %i (%" PRId64 " elements)\n",
+         cost.cross_transfers, cost.cross_elements);
+  printf("on-host transfers: %i (%" PRId64 " elements)\n",
+         cost.local_transfers, cost.local_elements);
+  printf("most butterflies on a node: %" PRId64 "\n", cost.max_work);
+  printf("butterflies on the critical path: %" PRId64 "\n",
+         cost.critical_path);
+}
+
+// Finds the index of a host's name, adding it if it is new. Returns -1 if it
+// is new and there is no room left for it.
+static int host_index(char names[][MAX_HOST_SIZE], int *count, int max,
+                      const char *name) {
+  for (int i = 0; i < *count; i++)
+    if (strcmp(names[i], name) == 0) return i;
+  if (*count == max) return -1;
+  strcpy(names[*count], name);
+  return (*count)++;
+}
+
+// Reads the slots= field of a hostfile line, the ranks placed on its host.
+// Returns 1 if the line gives none. The line is split up in the process.
+static int host_slots(char *line) {
+  char *field = strtok(line, " \t\n");  // The host's name
+  while ((field = strtok(NULL, " \t\n")) != NULL)
+    if (strncmp(field, "slots=", 6) == 0) return strtol(field + 6, NULL, 10);
+  return 1;
+}
+
+int read_host_hints(const char *filename, int hosts[], int nodes) {
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) return -1;
+
+  // Every rank could be on a host of its own, including the head node
+  char(*names)[MAX_HOST_SIZE] = malloc(sizeof(*names) * (nodes + 1));
+  if (names == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  int rank_host[nodes + 1];
+  for (int rank = 0; rank <= nodes; rank++) rank_host[rank] = -1;
+  int name_count = 0, next_rank = 0;
+
+  char line[MAX_LINE_SIZE], name[MAX_HOST_SIZE];
+  while (fgets(line, MAX_LINE_SIZE, fp)) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+    int rank;
+    if (sscanf(line, " rank %d = %255[^ \t\n]", &rank, name) == 2) {
+      if (rank < 0 || rank > nodes) continue;
+      rank_host[rank] = host_index(names, &name_count, nodes + 1, name);
+      if (rank_host[rank] < 0) break;
+    } else if (sscanf(line, " %255[^ \t\n]", name) == 1) {
+      int slots = host_slots(line);
+      int host = host_index(names, &name_count, nodes + 1, name);
+      for (; slots > 0 && next_rank <= nodes; slots--)
+        rank_host[next_rank++] = host;
+    }
+  }
+  fclose(fp);
+  free(names);
+
+  for (int rank = 1; rank <= nodes; rank++) {
+    if (rank_host[rank] < 0) return -1;
+    hosts[rank - 1] = rank_host[rank];
+  }
+  return 0;
+}
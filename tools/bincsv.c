@@ -0,0 +1,27 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+/**
+ * @brief Converts between the csv format and the binary format used by
+ * out-of-core transforms, reading standard input and writing standard output.
+ * With no arguments csv is turned into binary, with -r binary is turned back
+ * into csv printed the same way as print_complex(). Header lines and anything
+ * after the second column are not supported.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char *argv[]) {
+  double value[2];
+  if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+    while (fread(value, sizeof(double), 2, stdin) == 2)
+      printf("%f,%f\n", value[0], value[1]);
+    return 0;
+  }
+
+  while (scanf("%lf,%lf", &value[0], &value[1]) == 2)
+    fwrite(value, sizeof(double), 2, stdout);
+  return 0;
+}
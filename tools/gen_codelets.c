@@ -0,0 +1,75 @@
+//  Copyright (c) 2023 Zachary Todd Edwards
+//  MIT License
+
+/**
+ * @brief Build time generator for the small fixed size FFT kernels, or
+ * codelets, used for the leaves of fft(). Each codelet is the same
+ * decimation-in-time FFT as forward_fft() and inverse_fft() fully unrolled into
+ * straight-line code on local variables, with every twiddle factor written out
+ * as a constant and the trivial ones (1 and +-i) multiplied away. The generated
+ * C is written to standard output.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "codelets.h"
+
+#define M_TAU 6.28318530717958647692
+
+static void gen_butterfly(int a, int b, int j, int m, double sign) {
+  printf("  {\n");
+  if (j == 0) {  // w = 1
+    printf("    double tr = r%i, ti = i%i;\n", b, b);
+  } else if (4 * j == m) {  // w = sign * i
+    if (sign < 0)
+      printf("    double tr = i%i, ti = -r%i;\n", b, b);
+    else
+      printf("    double tr = -i%i, ti = r%i;\n", b, b);
+  } else {
+    double wr = cos(M_TAU * j / m), wi = sign * sin(M_TAU * j / m);
+    printf("    double tr = r%i * %.17g - i%i * %.17g;\n", b, wr, b, wi);
+    printf("    double ti = r%i * %.17g + i%i * %.17g;\n", b, wi, b, wr);
+  }
+  printf("    r%i = r%i - tr;\n", b, a);
+  printf("    i%i = i%i - ti;\n", b, a);
+  printf("    r%i += tr;\n", a);
+  printf("    i%i += ti;\n", a);
+  printf("  }\n");
+}
+
+static void gen_codelet(const char *direction, int n, double sign) {
+  printf("\nstatic void %s_codelet_%i(double complex X[]) {\n", direction, n);
+  if (n == 1) {  // The FFT of a single value is itself
+    printf("  (void)X;\n}\n");
+    return;
+  }
+  for (int k = 0; k < n; k++)
+    printf("  double r%i = creal(X[%i]), i%i = cimag(X[%i]);\n", k, k, k, k);
+  for (int m = 2; m <= n; m *= 2)
+    for (int k = 0; k < n; k += m)
+      for (int j = 0; j < m / 2; j++)
+        gen_butterfly(k + j, k + j + m / 2, j, m, sign);
+  for (int k = 0; k < n; k++) printf("  X[%i] = CMPLX(r%i, i%i);\n", k, k, k);
+  printf("}\n");
+}
+
+static void gen_table(const char *direction) {
+  printf("\nconst fft_codelet %s_codelets[] = {", direction);
+  for (int size = 1; size <= MAX_CODELET_SIZE; size *= 2)
+    printf("%s%s_codelet_%i", size > 1 ? ", " : "", direction, size);
+  printf("};\n");
+}
+
+int main() {
+  printf("// Generated by tools/gen_codelets.c, do not edit.\n\n");
+  printf("#include \"codelets.h\"\n");
+  for (int size = 1; size <= MAX_CODELET_SIZE; size *= 2) {
+    gen_codelet("forward", size, -1);
+    gen_codelet("inverse", size, 1);
+  }
+  gen_table("forward");
+  gen_table("inverse");
+  return 0;
+}